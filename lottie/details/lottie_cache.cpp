@@ -7,12 +7,19 @@
 #include "lottie/details/lottie_cache.h"
 
 #include "lottie/details/lottie_frame_renderer.h"
+#include "lottie/details/lottie_frame_trace.h"
+#include "lottie/details/lottie_work_stealing.h"
 #include "ffmpeg/ffmpeg_utility.h"
 #include "base/bytes.h"
 #include "base/assertion.h"
+#include "base/flat_set.h"
 
+#include <crl/crl_queue.h>
+#include <QCryptographicHash>
 #include <QDataStream>
+#include <QFile>
 #include <QIODevice>
+#include <QMutex>
 #include <range/v3/numeric/accumulate.hpp>
 
 namespace Lottie {
@@ -21,18 +28,340 @@ namespace {
 // Must not exceed max database allowed entry size.
 constexpr auto kMaxCacheSize = 10 * 1024 * 1024;
 
+// Indexed caches store every Nth frame without XOR-ing it with the
+// previous one, so any frame is reachable from the nearest keyframe.
+constexpr auto kKeyframeInterval = 30;
+
+// Frames from this size are split in bands of rows.
+constexpr auto kBandsMinArea = 640 * 640;
+
+// Palette8_LZ4 is kept only if the first frame leaves room in the
+// palette, otherwise later frames are likely to overflow it and the
+// whole cache would be encoded again.
+constexpr auto kPaletteFirstFrameColors = FramePalette::kMaxColors / 2;
+
+std::atomic<Cache::Encoder> DefaultEncoder
+	= Cache::Encoder::YUV420A4_LZ4_Rect;
+
+struct EncoderTraits {
+	Cache::Encoder defaultEncoder = Cache::Encoder::YUV420A4_LZ4_Rect;
+	int area = 0;
+	bool colorized = false;
+	bool tryPalette = false;
+};
+
+struct EncoderRule {
+	Cache::Encoder encoder = Cache::Encoder::YUV420A4_LZ4_Rect;
+	bool (*applies)(const EncoderTraits &traits) = nullptr;
+};
+
+[[nodiscard]] constexpr bool Automatic(const EncoderTraits &traits) {
+	return (traits.defaultEncoder == Cache::Encoder::YUV420A4_LZ4_Rect);
+}
+
+// The first rule that applies gives the encoder, the default one if none.
+constexpr EncoderRule kEncoderRules[] = {
+	{ Cache::Encoder::A8_LZ4, [](const EncoderTraits &traits) {
+		return traits.colorized;
+	} },
+	{ Cache::Encoder::Palette8_LZ4, [](const EncoderTraits &traits) {
+		return Automatic(traits) && traits.tryPalette;
+	} },
+	{ Cache::Encoder::YUV420A4_LZ4_Bands, [](const EncoderTraits &traits) {
+		return Automatic(traits) && (traits.area >= kBandsMinArea);
+	} },
+};
+
+[[nodiscard]] Cache::Encoder ChooseEncoder(const EncoderTraits &traits) {
+	for (const auto &rule : kEncoderRules) {
+		if (rule.applies(traits)) {
+			return rule.encoder;
+		}
+	}
+	return traits.defaultEncoder;
+}
+
+[[nodiscard]] Cache::Encoder ChooseEncoder(
+		QSize size,
+		const FrameRequest &request,
+		bool tryPalette) {
+	return ChooseEncoder({
+		.defaultEncoder = DefaultEncoder.load(std::memory_order_relaxed),
+		.area = size.width() * size.height(),
+		.colorized = (request.colored.alpha() != 0),
+		.tryPalette = tryPalette,
+	});
+}
+
+// Set in the encoder field of the header by Recompress(), even if LZ4HC
+// didn't make the cache smaller and it was kept as it is, so that the
+// same cache isn't recompressed again on each load.
+constexpr auto kRecompressedFlag = qint32(0x100);
+
+// Loaded caches are identified by the size, the header with the frame
+// offsets and the beginning of the frames.
+constexpr auto kUpgradeKeyBytes = 64 * 1024;
+
+// Each new cache data gets its own generation, the read contexts
+// prepared for the previous data are prepared again.
+std::atomic<int> Generations = 0;
+
+// Recompressions run one by one, so they don't compete with rendering.
+[[nodiscard]] crl::queue &RecompressionQueue() {
+	static auto result = crl::queue();
+	return result;
+}
+
+// Many players of the same animation may load the same cache, each one
+// is upgraded once, the keys of the stored upgrades are kept.
+struct Upgrades {
+	QMutex mutex;
+	base::flat_set<QByteArray> keys;
+};
+
+[[nodiscard]] Upgrades &LoadedUpgrades() {
+	static auto result = Upgrades();
+	return result;
+}
+
+[[nodiscard]] QByteArray UpgradeKey(const QByteArray &data) {
+	const auto size = qint64(data.size());
+	auto hash = QCryptographicHash(QCryptographicHash::Sha1);
+	hash.addData(QByteArray::fromRawData(
+		reinterpret_cast<const char*>(&size),
+		sizeof(size)));
+	hash.addData(QByteArray::fromRawData(
+		data.constData(),
+		std::min(int(data.size()), kUpgradeKeyBytes)));
+	return hash.result();
+}
+
+[[nodiscard]] bool StartUpgrade(const QByteArray &key) {
+	auto &upgrades = LoadedUpgrades();
+	QMutexLocker lock(&upgrades.mutex);
+	return upgrades.keys.insert(key).second;
+}
+
+void CancelUpgrade(const QByteArray &key) {
+	auto &upgrades = LoadedUpgrades();
+	QMutexLocker lock(&upgrades.mutex);
+	upgrades.keys.remove(key);
+}
+
 } // namespace
 
+struct Cache::Layout {
+	Encoder encoder = Encoder();
+	QSize size;
+	int headerSize = 0;
+	int indexOffset = 0;
+	int framesCount = 0;
+	bool indexed = false;
+	bool dictionary = false;
+	bool rectDelta = false;
+	bool bands = false;
+	bool palette = false;
+	bool singlePlane = false;
+};
+
+QByteArray Cache::Recompress(
+		const QByteArray &data,
+		const Layout &layout,
+		const std::atomic<bool> &cancelled) {
+	auto raw = EncodedStorage();
+	auto previous = EncodedStorage();
+	if (layout.singlePlane) {
+		raw.allocatePlane(layout.size.width(), layout.size.height());
+	} else {
+		raw.allocate(layout.size.width(), layout.size.height());
+	}
+	if (layout.dictionary) {
+		previous.allocate(layout.size.width(), layout.size.height());
+	}
+	auto palette = FramePalette();
+	auto compressed = QByteArray();
+	auto result = QByteArray();
+	result.reserve(data.size());
+	result.append(data.constData(), layout.headerSize);
+	auto offset = layout.headerSize;
+	for (auto i = 0; i != layout.framesCount; ++i) {
+		if (cancelled) {
+			return QByteArray();
+		}
+		auto length = qint32(0);
+		if (offset + int(sizeof(length)) > data.size()) {
+			return QByteArray();
+		}
+		memcpy(&length, data.constData() + offset, sizeof(length));
+		const auto delta = (length < 0);
+		if (delta) {
+			length = -length;
+		}
+		const auto from = bytes::make_span(data).subspan(
+			offset + sizeof(length));
+		if (length > int(from.size())) {
+			return QByteArray();
+		}
+		auto block = from.subspan(0, length);
+		const auto paletteFrom = (i % kKeyframeInterval) ? palette.size() : 0;
+		if (layout.palette) {
+			const auto read = palette.read(block);
+			if (read < 0) {
+				return QByteArray();
+			}
+			block = block.subspan(read);
+		}
+		const auto withPrevious = delta && layout.dictionary;
+		const auto withRect = delta && layout.rectDelta;
+		auto rect = QRect();
+		if (!(withPrevious
+			? UncompressWithPrevious(raw, block, previous)
+			: withRect
+			? UncompressRectDelta(raw, block, rect)
+			: layout.bands
+			? UncompressBands(raw, block, 1)
+			: UncompressToRaw(raw, block))) {
+			return QByteArray();
+		}
+		offset += sizeof(length) + length;
+
+		if (layout.bands) {
+			CompressBands(compressed, raw, delta, 1, true);
+		} else if (withPrevious) {
+			CompressWithPrevious(compressed, raw, previous, true);
+		} else if (withRect) {
+			CompressRectRows(compressed, raw, rect, true);
+			const auto negativeLength = -qint32(
+				compressed.size() - sizeof(qint32));
+			memcpy(compressed.data(), &negativeLength, sizeof(qint32));
+		} else {
+			CompressFromRaw(compressed, raw, true);
+			if (delta) {
+				const auto negativeLength = -qint32(
+					compressed.size() - sizeof(qint32));
+				memcpy(compressed.data(), &negativeLength, sizeof(qint32));
+			}
+			if (layout.palette) {
+				palette.write(compressed, paletteFrom);
+			}
+		}
+		if (layout.dictionary) {
+			std::swap(raw, previous);
+		}
+		if (layout.indexed) {
+			const auto frameOffset = qint32(result.size());
+			memcpy(
+				result.data() + layout.indexOffset + i * sizeof(qint32),
+				&frameOffset,
+				sizeof(qint32));
+		}
+		result.append(compressed);
+	}
+	if (result.size() >= data.size()) {
+		// Keep it as it is, but don't try again on the next load.
+		result = data;
+	}
+	QDataStream stream(&result, QIODevice::ReadWrite);
+	stream << (static_cast<qint32>(layout.encoder) | kRecompressedFlag);
+	return result;
+}
+
+CacheMapping::CacheMapping(
+	bytes::const_span data,
+	std::shared_ptr<const void> owner)
+: _owner(std::move(owner))
+, _data(data) {
+}
+
+CacheMapping::CacheMapping(std::unique_ptr<QFile> file)
+: _file(std::move(file)) {
+	const auto size = _file->size();
+	if (size > 0 && size <= kMaxCacheSize) {
+		if (const auto mapped = _file->map(0, size)) {
+			_data = bytes::const_span(
+				reinterpret_cast<const bytes::type*>(mapped),
+				size);
+		}
+	}
+}
+
+CacheMapping::~CacheMapping() = default;
+
+std::shared_ptr<CacheMapping> CacheMapping::Map(const QString &path) {
+	auto file = std::make_unique<QFile>(path);
+	if (!file->open(QIODevice::ReadOnly)) {
+		return nullptr;
+	}
+	// The mapping lives as long as the file is open.
+	auto result = std::shared_ptr<CacheMapping>(
+		new CacheMapping(std::move(file)));
+	return result->_data.empty() ? nullptr : result;
+}
+
+QByteArray CacheMapping::data() const {
+	return QByteArray::fromRawData(
+		reinterpret_cast<const char*>(_data.data()),
+		_data.size());
+}
+
+struct Cache::Recompression {
+	~Recompression();
+
+	QMutex mutex;
+	QByteArray result;
+	bool finished = false;
+	std::atomic<bool> cancelled = false;
+
+	// An upgrade of a loaded cache that wasn't stored may be started
+	// again by another player loading the same cache.
+	QByteArray upgradeKey;
+	bool stored = false;
+};
+
+Cache::Recompression::~Recompression() {
+	if (!upgradeKey.isEmpty() && !stored) {
+		CancelUpgrade(upgradeKey);
+	}
+}
+
+Cache::Cache(
+	const QByteArray &data,
+	const FrameRequest &request,
+	FnMut<void(QByteArray &&cached)> put)
+: Cache(data, nullptr, request, std::move(put)) {
+}
+
+Cache::Cache(
+	std::shared_ptr<const CacheMapping> mapping,
+	const FrameRequest &request,
+	FnMut<void(QByteArray &&cached)> put)
+: Cache(
+	mapping ? mapping->data() : QByteArray(),
+	mapping,
+	request,
+	std::move(put)) {
+}
+
 Cache::Cache(
 	const QByteArray &data,
+	const std::shared_ptr<const CacheMapping> &mapping,
 	const FrameRequest &request,
 	FnMut<void(QByteArray &&cached)> put)
-: _data(data)
+: _mapping(mapping)
+, _data(data)
 , _put(std::move(put)) {
+	// Reading never detaches _data, so mapped frames are read in place.
 	if (!readHeader(request)) {
 		_framesReady = 0;
-		_framesInData = 0;
+		_framesPut = 0;
 		_data = QByteArray();
+		_mapping = nullptr;
+	} else if (!_recompressed && _framesReady == _framesCount && _put) {
+		// Complete caches written before LZ4HC are upgraded once.
+		auto key = UpgradeKey(_data);
+		if (StartUpgrade(key)) {
+			startRecompression(std::move(key));
+		}
 	}
 }
 
@@ -41,7 +370,12 @@ Cache::Cache(Cache &&) = default;
 Cache &Cache::operator=(Cache&&) = default;
 
 Cache::~Cache() {
+	// Only an incomplete cache may be left, it is not recompressed.
 	finalizeEncoding();
+	if (_recompression) {
+		_recompression->cancelled = true;
+		applyRecompressed();
+	}
 }
 
 void Cache::init(
@@ -54,10 +388,15 @@ void Cache::init(
 	_frameRate = frameRate;
 	_framesCount = framesCount;
 	_framesReady = 0;
-	_framesInData = 0;
+	_framesPut = 0;
+	_encoder = ChooseEncoder(_size, request, !_paletteOverflow);
 	prepareBuffers();
 }
 
+void Cache::SetDefaultEncoder(Encoder encoder) {
+	DefaultEncoder.store(encoder, std::memory_order_relaxed);
+}
+
 int Cache::sizeRounding() const {
 	return 8;
 }
@@ -86,7 +425,16 @@ bool Cache::readHeader(const FrameRequest &request) {
 
 	auto encoder = qint32(0);
 	stream >> encoder;
-	if (static_cast<Encoder>(encoder) != Encoder::YUV420A4_LZ4) {
+	_recompressed = (encoder & kRecompressedFlag) != 0;
+	encoder &= ~kRecompressedFlag;
+	const auto kind = static_cast<Encoder>(encoder);
+	if (kind != Encoder::YUV420A4_LZ4
+		&& kind != Encoder::YUV420A4_LZ4_Indexed
+		&& kind != Encoder::YUV420A4_LZ4_Dictionary
+		&& kind != Encoder::YUV420A4_LZ4_Rect
+		&& kind != Encoder::YUV420A4_LZ4_Bands
+		&& kind != Encoder::A8_LZ4
+		&& kind != Encoder::Palette8_LZ4) {
 		return false;
 	}
 	auto size = QSize();
@@ -114,12 +462,18 @@ bool Cache::readHeader(const FrameRequest &request) {
 		return false;
 	}
 	_encoder = static_cast<Encoder>(encoder);
+	if (!goodForRequest(request)) {
+		return false;
+	}
 	_size = size;
 	_original = original;
 	_frameRate = frameRate;
 	_framesCount = framesCount;
 	_framesReady = framesReady;
-	_framesInData = framesReady;
+	_framesPut = framesReady;
+	if (_data.size() < headerSize()) {
+		return false;
+	}
 	prepareBuffers();
 	return (renderFrame(_firstFrame, request, 0) == FrameRenderResult::Ok);
 }
@@ -132,15 +486,22 @@ FrameRenderResult Cache::renderFrame(
 		QImage &to,
 		const FrameRequest &request,
 		int index) {
+	if (_recompression) {
+		applyRecompressed();
+	}
 	const auto result = renderFrame(_readContext, to, request, index);
 	if (result == FrameRenderResult::Ok) {
-		if (index + 1 == _framesReady && _data.size() > _readContext.offset) {
+		// Resizing mapped data would copy it, appendFrame() does it.
+		if (index + 1 == _framesReady
+			&& _data.size() > _readContext.offset
+			&& !_mapping) {
 			_data.resize(_readContext.offset);
 		}
 	} else if (result == FrameRenderResult::BadCacheSize) {
 		_framesReady = 0;
-		_framesInData = 0;
+		_framesPut = 0;
 		_data.clear();
+		_mapping = nullptr;
 	}
 	return result;
 }
@@ -150,106 +511,442 @@ FrameRenderResult Cache::renderFrame(
 		QImage &to,
 		const FrameRequest &request,
 		int index) const {
-	Expects(index >= _framesReady
-		|| index == context.offsetFrameIndex
-		|| index == 0);
 	Expects(index >= _framesReady || context.ready());
 
+	const auto trace = TraceScope("cache.renderFrame", this, index);
+
 	if (index >= _framesReady) {
 		return FrameRenderResult::NotReady;
-	} else if (request.size(_original, sizeRounding()) != _size) {
+	} else if (request.size(_original, sizeRounding()) != _size
+		|| !goodForRequest(request)) {
 		return FrameRenderResult::BadCacheSize;
-	} else if (index == 0) {
-		context.offsetFrameIndex = 0;
-		context.offset = headerSize();
+	} else if (context.generation != _generation) {
+		// The data was replaced, the offsets point into the previous one.
+		prepareBuffers(context);
 	}
-	const auto [ok, xored] = readCompressedFrame(context);
-	if (!ok || (xored && index == 0)) {
+	const auto keyframe = keyframeBefore(index);
+	context.changed = QRect();
+
+	// XOR deltas are symmetric, step backwards while it is cheaper
+	// than reading forward from the nearest keyframe.
+	auto stepped = false;
+	while (index + 1 < context.offsetFrameIndex
+		&& (context.offsetFrameIndex - 1 - index <= index - keyframe + 1)
+		&& readPreviousFrame(context)) {
+		stepped = true;
+	}
+	if (stepped && index + 1 == context.offsetFrameIndex) {
+		decode(to, context, request);
+		return FrameRenderResult::Ok;
+	}
+	if (index < context.offsetFrameIndex
+		|| keyframe > context.offsetFrameIndex) {
+		if (!seekToFrame(context, keyframe)) {
+			return FrameRenderResult::Failed;
+		}
+	}
+
+	// Skipped frames are only uncompressed, not decoded.
+	while (context.offsetFrameIndex < index) {
+		if (!readNextFrame(context)) {
+			return FrameRenderResult::Failed;
+		}
+	}
+	if (!readNextFrame(context)) {
 		return FrameRenderResult::Failed;
 	}
-	if (xored) {
+	decode(to, context, request);
+	return FrameRenderResult::Ok;
+}
+
+void Cache::decode(
+		QImage &to,
+		const CacheReadContext &context,
+		const FrameRequest &request) const {
+	if (alphaOnly()) {
+		DecodeAlpha(to, context.previous, _size, request.colored);
+	} else if (palette()) {
+		DecodePalette(to, context.previous, _size, context.palette);
+	} else {
+		Decode(to, context.previous, _size, threads());
+	}
+}
+
+bool Cache::readNextFrame(CacheReadContext &context) const {
+	const auto keyframe = isKeyframe(context.offsetFrameIndex);
+	const auto [ok, delta, rect] = readCompressedFrame(context);
+	if (!ok || (delta && keyframe)) {
+		return false;
+	}
+	if (delta && rectDelta()) {
+		XorRect(context.previous, context.uncompressed, rect);
+		context.changed |= rect;
+	} else if (delta && !dictionary()) {
 		Xor(context.previous, context.uncompressed);
+		context.changed = QRect(QPoint(), _size);
 	} else {
 		std::swap(context.uncompressed, context.previous);
+		context.changed = QRect(QPoint(), _size);
 	}
-	Decode(to, context.previous, _size, context.decodeContext);
-	return FrameRenderResult::Ok;
+	return true;
+}
+
+bool Cache::readPreviousFrame(CacheReadContext &context) const {
+	// The context has the frame (offsetFrameIndex - 1) in 'previous'.
+	const auto index = context.offsetFrameIndex - 1;
+	if (!reversible() || index <= 0 || isKeyframe(index)) {
+		return false;
+	}
+	const auto offset = frameOffset(index);
+	if (!offset) {
+		return false;
+	}
+	const auto was = context.offset;
+	context.offset = offset;
+	context.offsetFrameIndex = index;
+	const auto [ok, delta, rect] = readCompressedFrame(context);
+	if (!ok || !delta) {
+		context.offset = was;
+		context.offsetFrameIndex = index + 1;
+		return false;
+	}
+	if (rectDelta()) {
+		XorRect(context.previous, context.uncompressed, rect);
+		context.changed |= rect;
+	} else {
+		Xor(context.previous, context.uncompressed);
+		context.changed = QRect(QPoint(), _size);
+	}
+	context.offset = offset;
+	context.offsetFrameIndex = index;
+	return true;
 }
 
 void Cache::appendFrame(
 		const QImage &frame,
 		const FrameRequest &request,
 		int index) {
-	if (request.size(_original, sizeRounding()) != _size) {
+	const auto trace = TraceScope("cache.appendFrame", this, index);
+	if (request.size(_original, sizeRounding()) != _size
+		|| !goodForRequest(request)) {
 		_framesReady = 0;
-		_framesInData = 0;
+		_framesPut = 0;
 		_data = QByteArray();
 	}
 	if (index != _framesReady) {
 		return;
+	} else if (index > 0 && _readContext.offsetFrameIndex != index) {
+		// After a skip the previous frame is not in the context.
+		return;
 	} else if (index == 0) {
 		_size = request.size(_original, sizeRounding());
+		_encoder = ChooseEncoder(_size, request, !_paletteOverflow);
 		_encode = EncodeFields();
-		_encode.compressedFrames.reserve(_framesCount);
 		prepareBuffers();
 	}
 	Assert(frame.size() == _size);
 	Assert(_readContext.ready());
-	Encode(_readContext.uncompressed, frame, _encode.cache, _encode.context);
-	CompressAndSwapFrame(
-		_encode.compressBuffer,
-		(index != 0) ? &_encode.xorCompressBuffer : nullptr,
-		_readContext.uncompressed,
-		_readContext.previous);
-	const auto compressed = _encode.compressBuffer;
-	const auto nowSize = (_data.isEmpty() ? headerSize() : _data.size())
-		+ _encode.totalSize;
-	const auto totalSize = nowSize + compressed.size();
-	if (nowSize <= kMaxCacheSize && totalSize > kMaxCacheSize) {
+	const auto paletteFrom = isKeyframe(index)
+		? 0
+		: _readContext.palette.size();
+	if (palette()
+		&& (!EncodePalette(
+			_readContext.uncompressed,
+			frame,
+			_readContext.palette)
+			|| (!index
+				&& _readContext.palette.size() > kPaletteFirstFrameColors))) {
+		// Too many colors, all the frames are written without a palette.
+		_paletteOverflow = true;
+		if (index > 0) {
+			if (!reencodeWithoutPalette(request)) {
+				return;
+			}
+		} else {
+			_encoder = ChooseEncoder(_size, request, false);
+			_encode = EncodeFields();
+			prepareBuffers();
+		}
+	}
+	if (alphaOnly()) {
+		EncodeAlpha(_readContext.uncompressed, frame);
+	} else if (!palette()) {
+		Encode(_readContext.uncompressed, frame);
+	}
+	if (bands()) {
+		const auto delta = !isKeyframe(index);
+		std::swap(_readContext.uncompressed, _readContext.previous);
+		if (delta) {
+			Xor(_readContext.uncompressed, _readContext.previous);
+		}
+		CompressBands(
+			_encode.compressBuffer,
+			delta ? _readContext.uncompressed : _readContext.previous,
+			delta,
+			threads());
+	} else if (rectDelta() && !isKeyframe(index)) {
+		_encode.rectRows.allocate(_size.width(), _size.height());
+		CompressRectDelta(
+			_encode.compressBuffer,
+			_encode.rectRows,
+			_readContext.uncompressed,
+			_readContext.previous);
+		std::swap(_readContext.uncompressed, _readContext.previous);
+	} else if (dictionary() && !isKeyframe(index)) {
+		CompressWithPrevious(
+			_encode.compressBuffer,
+			_readContext.uncompressed,
+			_readContext.previous);
+		std::swap(_readContext.uncompressed, _readContext.previous);
+	} else {
+		CompressAndSwapFrame(
+			_encode.compressBuffer,
+			((isKeyframe(index) || dictionary() || rectDelta())
+				? nullptr
+				: &_encode.xorCompressBuffer),
+			_readContext.uncompressed,
+			_readContext.previous);
+		if (palette()) {
+			_readContext.palette.write(_encode.compressBuffer, paletteFrom);
+		}
+	}
+
+	// Frames go right after the previous ones, readers find them there.
+	if (!index) {
+		_data = QByteArray();
+		_mapping = nullptr;
+		writeHeader();
+	} else if (_mapping) {
+		// Appended data is owned, the mapped frames are copied once.
+		_data = QByteArray(_data.constData(), _readContext.offset);
+		_mapping = nullptr;
+	}
+	const auto offset = _data.size();
+	const auto size = _encode.compressBuffer.size();
+	if (offset <= kMaxCacheSize && offset + size > kMaxCacheSize) {
 		// Write to cache while we still can.
 		finalizeEncoding();
 	}
-	_encode.totalSize += compressed.size();
-	_encode.compressedFrames.push_back(compressed);
-	_encode.compressedFrames.back().detach();
+	_data.append(_encode.compressBuffer);
+	writeFrameOffset(index, offset);
 	++_readContext.offsetFrameIndex;
-	_readContext.offset += compressed.size();
+	_readContext.offset += size;
 	if (++_framesReady == _framesCount) {
 		finalizeEncoding();
+		if (_backgroundRecompression && _put) {
+			startRecompression();
+		}
 	}
 }
 
+bool Cache::reencodeWithoutPalette(const FrameRequest &request) {
+	Expects(palette());
+
+	// The frames written with the palette are read back and written
+	// again without it, so that they are not rendered again.
+	const auto count = _framesReady;
+	updateFramesReadyCount();
+	auto source = Cache(_data, request, FnMut<void(QByteArray &&cached)>());
+	_framesReady = 0;
+	_framesPut = 0;
+	_data = QByteArray();
+	auto frame = QImage();
+	for (auto i = 0; i != count; ++i) {
+		if (source.renderFrame(frame, request, i) != FrameRenderResult::Ok) {
+			_framesReady = 0;
+			_data = QByteArray();
+			_encode = EncodeFields();
+			prepareBuffers();
+			return false;
+		}
+		appendFrame(frame, request, i);
+	}
+	return (_framesReady == count);
+}
+
 void Cache::finalizeEncoding() {
-	if (_encode.compressedFrames.empty() || !_put) {
+	if (_framesPut == _framesReady || !_put) {
 		return;
 	}
-	const auto size = (_data.isEmpty() ? headerSize() : _data.size())
-		+ _encode.totalSize;
-	if (_data.isEmpty()) {
-		_data.reserve(size);
-		writeHeader();
-	} else {
-		updateFramesReadyCount();
+	updateFramesReadyCount();
+	_framesPut = _framesReady;
+	if (_framesReady == _framesCount) {
+		_encode = EncodeFields();
+		_data.squeeze();
 	}
-	const auto offset = _data.size();
-	_data.resize(size);
-	auto to = _data.data() + offset;
-	for (const auto &block : _encode.compressedFrames) {
-		const auto amount = qint32(block.size());
-		memcpy(to, block.data(), amount);
-		to += amount;
-	}
-	_framesInData = _framesReady;
 	if (_data.size() <= kMaxCacheSize) {
 		_put(QByteArray(_data));
 	}
-	_encode = EncodeFields();
+}
+
+void Cache::setBackgroundRecompression(bool enabled) {
+	_backgroundRecompression = enabled;
+}
+
+QByteArray Cache::recompressed(const std::atomic<bool> &cancelled) const {
+	return (_framesReady == _framesCount && _framesPut == _framesReady)
+		? Recompress(_data, layout(), cancelled)
+		: QByteArray();
+}
+
+void Cache::startRecompression(QByteArray upgradeKey) {
+	Expects(_framesReady == _framesCount);
+
+	if (_recompression) {
+		_recompression->cancelled = true;
+	}
+	_recompression = std::make_shared<Recompression>();
+	_recompression->upgradeKey = std::move(upgradeKey);
+	const auto layout = this->layout();
+	RecompressionQueue().async([
+			mapping = _mapping,
+			data = _data,
+			layout,
+			recompression = _recompression] {
+		auto result = Recompress(data, layout, recompression->cancelled);
+		QMutexLocker lock(&recompression->mutex);
+		recompression->result = std::move(result);
+		recompression->finished = true;
+	});
+}
+
+void Cache::applyRecompressed() {
+	Expects(_recompression != nullptr);
+
+	auto result = QByteArray();
+	{
+		QMutexLocker lock(&_recompression->mutex);
+		if (!_recompression->finished) {
+			return;
+		}
+		std::swap(result, _recompression->result);
+	}
+
+	// Readers keep offsets into the current data,
+	// so only the stored cache is replaced.
+	if (!result.isEmpty() && result.size() <= kMaxCacheSize && _put) {
+		_recompression->stored = true;
+		_put(std::move(result));
+	}
+	_recompression = nullptr;
 }
 
 int Cache::headerSize() const {
+	return indexOffset() + (indexed() ? (_framesCount * sizeof(qint32)) : 0);
+}
+
+int Cache::indexOffset() const {
 	return 8 * sizeof(qint32);
 }
 
+auto Cache::layout() const -> Layout {
+	return {
+		.encoder = _encoder,
+		.size = _size,
+		.headerSize = headerSize(),
+		.indexOffset = indexOffset(),
+		.framesCount = _framesCount,
+		.indexed = indexed(),
+		.dictionary = dictionary(),
+		.rectDelta = rectDelta(),
+		.bands = bands(),
+		.palette = palette(),
+		.singlePlane = singlePlane(),
+	};
+}
+
+bool Cache::canSeekBackward() const {
+	return indexed();
+}
+
+bool Cache::indexed() const {
+	return (_encoder == Encoder::YUV420A4_LZ4_Indexed)
+		|| (_encoder == Encoder::YUV420A4_LZ4_Dictionary)
+		|| (_encoder == Encoder::YUV420A4_LZ4_Rect)
+		|| (_encoder == Encoder::YUV420A4_LZ4_Bands)
+		|| (_encoder == Encoder::A8_LZ4)
+		|| (_encoder == Encoder::Palette8_LZ4);
+}
+
+bool Cache::dictionary() const {
+	return (_encoder == Encoder::YUV420A4_LZ4_Dictionary);
+}
+
+bool Cache::rectDelta() const {
+	return (_encoder == Encoder::YUV420A4_LZ4_Rect);
+}
+
+bool Cache::reversible() const {
+	// Dictionary deltas can't be undone, XOR ones can.
+	return (_encoder == Encoder::YUV420A4_LZ4_Indexed)
+		|| (_encoder == Encoder::YUV420A4_LZ4_Rect)
+		|| (_encoder == Encoder::YUV420A4_LZ4_Bands)
+		|| (_encoder == Encoder::A8_LZ4)
+		|| (_encoder == Encoder::Palette8_LZ4);
+}
+
+bool Cache::bands() const {
+	return (_encoder == Encoder::YUV420A4_LZ4_Bands);
+}
+
+bool Cache::alphaOnly() const {
+	return (_encoder == Encoder::A8_LZ4);
+}
+
+bool Cache::palette() const {
+	return (_encoder == Encoder::Palette8_LZ4);
+}
+
+bool Cache::singlePlane() const {
+	return alphaOnly() || palette();
+}
+
+bool Cache::goodForRequest(const FrameRequest &request) const {
+	// Alpha only frames can't be shown without a color.
+	return !alphaOnly() || (request.colored.alpha() != 0);
+}
+
+int Cache::threads() const {
+	return bands() ? MaxWorkerThreads() : 1;
+}
+
+bool Cache::isKeyframe(int index) const {
+	return !index || (indexed() && !(index % kKeyframeInterval));
+}
+
+int Cache::keyframeBefore(int index) const {
+	return indexed() ? (index - (index % kKeyframeInterval)) : 0;
+}
+
+int Cache::frameOffset(int index) const {
+	Expects(index >= 0 && index < _framesReady);
+
+	if (!index) {
+		return headerSize();
+	} else if (!indexed()) {
+		return 0;
+	}
+	auto result = qint32(0);
+	bytes::copy(
+		bytes::object_as_span(&result),
+		bytes::make_span(_data).subspan(
+			indexOffset() + index * sizeof(qint32),
+			sizeof(qint32)));
+	return (result >= headerSize() && result < _data.size()) ? result : 0;
+}
+
+bool Cache::seekToFrame(CacheReadContext &context, int index) const {
+	Expects(isKeyframe(index));
+
+	const auto offset = frameOffset(index);
+	if (!offset) {
+		return false;
+	}
+	context.offset = offset;
+	context.offsetFrameIndex = index;
+	return true;
+}
+
 void Cache::writeHeader() {
 	Expects(_data.isEmpty());
 
@@ -262,17 +959,38 @@ void Cache::writeHeader() {
 		<< qint32(_frameRate)
 		<< qint32(_framesCount)
 		<< qint32(_framesReady);
+	if (indexed()) {
+		// Frame offsets table, filled in writeFrameOffset().
+		for (auto i = 0; i != _framesCount; ++i) {
+			stream << qint32(0);
+		}
+	}
 }
 
 void Cache::updateFramesReadyCount() {
 	Expects(_data.size() >= headerSize());
 
 	QDataStream stream(&_data, QIODevice::ReadWrite);
-	stream.device()->seek(headerSize() - sizeof(qint32));
+	stream.device()->seek(indexOffset() - sizeof(qint32));
 	stream << qint32(_framesReady);
 }
 
+void Cache::writeFrameOffset(int index, int offset) {
+	Expects(_data.size() >= headerSize());
+
+	if (!indexed()) {
+		return;
+	}
+	const auto value = qint32(offset);
+	bytes::copy(
+		bytes::make_detached_span(_data).subspan(
+			indexOffset() + index * sizeof(qint32),
+			sizeof(qint32)),
+		bytes::object_as_span(&value));
+}
+
 void Cache::prepareBuffers() {
+	_generation = ++Generations;
 	prepareBuffers(_readContext);
 }
 
@@ -285,8 +1003,15 @@ void Cache::prepareBuffers(CacheReadContext &context) const {
 	const auto bytesPerLine = _size.width();
 	context.offset = headerSize();
 	context.offsetFrameIndex = 0;
-	context.uncompressed.allocate(bytesPerLine, _size.height());
-	context.previous.allocate(bytesPerLine, _size.height());
+	context.generation = _generation;
+	context.palette.clear();
+	if (singlePlane()) {
+		context.uncompressed.allocatePlane(bytesPerLine, _size.height());
+		context.previous.allocatePlane(bytesPerLine, _size.height());
+	} else {
+		context.uncompressed.allocate(bytesPerLine, _size.height());
+		context.previous.allocate(bytesPerLine, _size.height());
+	}
 }
 
 void Cache::keepUpContext(CacheReadContext &context) const {
@@ -301,6 +1026,9 @@ void Cache::keepUpContext(CacheReadContext &context) const {
 	}
 	context.offset = _readContext.offset;
 	context.offsetFrameIndex = _readContext.offsetFrameIndex;
+	context.generation = _readContext.generation;
+	context.changed = _readContext.changed;
+	context.palette = _readContext.palette;
 	memcpy(
 		context.previous.data(),
 		_readContext.previous.data(),
@@ -316,39 +1044,54 @@ Cache::ReadResult Cache::readCompressedFrame(
 	Expects(context.ready());
 
 	auto length = qint32(0);
-	const auto part = [&] {
-		if (context.offsetFrameIndex >= _framesInData) {
-			// One reader is still accumulating compressed frames,
-			// while second reader already started reading after the first.
-			const auto readyIndex = context.offsetFrameIndex - _framesInData;
-			Assert(readyIndex < _encode.compressedFrames.size());
-			return bytes::make_span(_encode.compressedFrames[readyIndex]);
-		} else if (_data.size() > context.offset) {
-			return bytes::make_span(_data).subspan(context.offset);
-		} else {
-			return bytes::const_span();
-		}
-	}();
+	const auto part = (_data.size() > context.offset)
+		? bytes::make_span(_data).subspan(context.offset)
+		: bytes::const_span();
 	if (part.size() < sizeof(length)) {
-		return { false };
+		return { false, false, QRect() };
 	}
 	bytes::copy(
 		bytes::object_as_span(&length),
 		part.subspan(0, sizeof(length)));
 	const auto bytes = part.subspan(sizeof(length));
 
-	const auto xored = (length < 0);
-	if (xored) {
+	const auto delta = (length < 0);
+	if (delta) {
 		length = -length;
 	}
-	const auto ok = (length <= bytes.size())
-		? UncompressToRaw(context.uncompressed, bytes.subspan(0, length))
-		: false;
+	auto rect = QRect();
+	auto paletteSize = 0;
+	if (palette() && length <= int(bytes.size())) {
+		paletteSize = context.palette.read(bytes.subspan(0, length));
+		if (paletteSize < 0) {
+			return { false, false, QRect() };
+		}
+	}
+	const auto ok = (length > int(bytes.size()))
+		? false
+		: (delta && dictionary())
+		? UncompressWithPrevious(
+			context.uncompressed,
+			bytes.subspan(0, length),
+			context.previous)
+		: (delta && rectDelta())
+		? UncompressRectDelta(
+			context.uncompressed,
+			bytes.subspan(0, length),
+			rect)
+		: bands()
+		? UncompressBands(
+			context.uncompressed,
+			bytes.subspan(0, length),
+			threads())
+		: UncompressToRaw(
+			context.uncompressed,
+			bytes.subspan(paletteSize, length - paletteSize));
 	if (ok) {
 		context.offset += sizeof(length) + length;
 		++context.offsetFrameIndex;
 	}
-	return { ok, xored };
+	return { ok, delta, rect };
 }
 
 } // namespace Lottie
@@ -9,22 +9,57 @@
 #include "ffmpeg/ffmpeg_utility.h"
 #include "lottie/details/lottie_cache_frame_storage.h"
 #include "lottie/lottie_common.h"
+#include "base/bytes.h"
 
 #include <QImage>
 #include <QSize>
 #include <QByteArray>
+#include <QString>
+#include <memory>
+
+class QFile;
 
 namespace Lottie {
 
 struct FrameRequest;
 
+// Immutable cache contents owned outside of QByteArray, like a mapped
+// file. All the caches reading it share the same pages without a copy.
+class CacheMapping final {
+public:
+	CacheMapping(bytes::const_span data, std::shared_ptr<const void> owner);
+	~CacheMapping();
+
+	// Returns nullptr if the file can't be mapped.
+	[[nodiscard]] static std::shared_ptr<CacheMapping> Map(
+		const QString &path);
+
+	// Doesn't own the data, valid while the mapping is alive.
+	[[nodiscard]] QByteArray data() const;
+
+private:
+	explicit CacheMapping(std::unique_ptr<QFile> file);
+
+	std::unique_ptr<QFile> _file;
+	std::shared_ptr<const void> _owner;
+	bytes::const_span _data;
+
+};
+
 struct CacheReadContext {
 	EncodedStorage uncompressed;
 	EncodedStorage previous;
-	FFmpeg::SwscalePointer decodeContext;
+	FramePalette palette;
 	int offset = 0;
 	int offsetFrameIndex = 0;
 
+	// Offsets are valid only in the cache data of the same generation.
+	int generation = 0;
+
+	// Part of the last rendered frame that differs from the one
+	// rendered before it with the same context.
+	QRect changed;
+
 	[[nodiscard]] bool ready() const {
 		return (offset != 0);
 	}
@@ -34,12 +69,31 @@ class Cache {
 public:
 	enum class Encoder : qint8 {
 		YUV420A4_LZ4,
+		YUV420A4_LZ4_Indexed,
+		YUV420A4_LZ4_Dictionary,
+		YUV420A4_LZ4_Rect,
+		YUV420A4_LZ4_Bands,
+		A8_LZ4,
+		Palette8_LZ4,
 	};
 
+	// Encoder for the caches written from now on, any one is read.
+	// With YUV420A4_LZ4_Rect, the default one, large frames are written
+	// by YUV420A4_LZ4_Bands to be encoded and decoded in parallel.
+	// Colorized requests are always written by A8_LZ4, only alpha matters.
+	// With the default one Palette8_LZ4 is tried first and kept if the
+	// first frame uses at most half of its 256 colors, if a later frame
+	// overflows it the frames written so far are encoded again without it.
+	static void SetDefaultEncoder(Encoder encoder);
+
 	Cache(
 		const QByteArray &data,
 		const FrameRequest &request,
 		FnMut<void(QByteArray &&cached)> put);
+	Cache(
+		std::shared_ptr<const CacheMapping> mapping,
+		const FrameRequest &request,
+		FnMut<void(QByteArray &&cached)> put);
 	Cache(Cache &&);
 	Cache &operator=(Cache&&);
 	~Cache();
@@ -56,6 +110,10 @@ public:
 	[[nodiscard]] QSize originalSize() const;
 	[[nodiscard]] QImage takeFirstFrame();
 
+	// YUV420A4_LZ4 has no frame offsets, each frame before the current
+	// one is read again from the start.
+	[[nodiscard]] bool canSeekBackward() const;
+
 	void prepareBuffers(CacheReadContext &context) const;
 	void keepUpContext(CacheReadContext &context) const;
 
@@ -73,31 +131,80 @@ public:
 		const FrameRequest &request,
 		int index);
 
+	// Complete caches are recompressed with LZ4HC in the background.
+	// Caches encoded on a worker thread may do it right there instead.
+	void setBackgroundRecompression(bool enabled);
+	[[nodiscard]] QByteArray recompressed(
+		const std::atomic<bool> &cancelled) const;
+
 private:
+	struct Layout;
+	struct Recompression;
+
+	Cache(
+		const QByteArray &data,
+		const std::shared_ptr<const CacheMapping> &mapping,
+		const FrameRequest &request,
+		FnMut<void(QByteArray &&cached)> put);
+
 	struct ReadResult {
 		bool ok = false;
-		bool xored = false;
+		bool delta = false;
+		QRect rect;
 	};
 	struct EncodeFields {
-		std::vector<QByteArray> compressedFrames;
 		QByteArray compressBuffer;
 		QByteArray xorCompressBuffer;
-		QImage cache;
-		FFmpeg::SwscalePointer context;
-		int totalSize = 0;
+		EncodedStorage rectRows;
 	};
+	[[nodiscard]] static QByteArray Recompress(
+		const QByteArray &data,
+		const Layout &layout,
+		const std::atomic<bool> &cancelled);
+
 	int headerSize() const;
+	int indexOffset() const;
+	[[nodiscard]] Layout layout() const;
+	[[nodiscard]] bool indexed() const;
+	[[nodiscard]] bool dictionary() const;
+	[[nodiscard]] bool rectDelta() const;
+	[[nodiscard]] bool reversible() const;
+	[[nodiscard]] bool bands() const;
+	[[nodiscard]] bool alphaOnly() const;
+	[[nodiscard]] bool palette() const;
+	[[nodiscard]] bool singlePlane() const;
+	[[nodiscard]] bool goodForRequest(const FrameRequest &request) const;
+	[[nodiscard]] int threads() const;
+	[[nodiscard]] bool isKeyframe(int index) const;
+	[[nodiscard]] int keyframeBefore(int index) const;
+	[[nodiscard]] int frameOffset(int index) const;
+	[[nodiscard]] bool seekToFrame(
+		CacheReadContext &context,
+		int index) const;
 	void prepareBuffers();
+	[[nodiscard]] bool reencodeWithoutPalette(const FrameRequest &request);
 	void finalizeEncoding();
 
 	void writeHeader();
 	void updateFramesReadyCount();
+	void writeFrameOffset(int index, int offset);
+	void startRecompression(QByteArray upgradeKey = QByteArray());
+	void applyRecompressed();
 	[[nodiscard]] bool readHeader(const FrameRequest &request);
 	[[nodiscard]] ReadResult readCompressedFrame(
 		CacheReadContext &context) const;
+	[[nodiscard]] bool readNextFrame(CacheReadContext &context) const;
+	[[nodiscard]] bool readPreviousFrame(CacheReadContext &context) const;
+	void decode(
+		QImage &to,
+		const CacheReadContext &context,
+		const FrameRequest &request) const;
 
+	// Keeps alive the data that _data may point to without owning it.
+	std::shared_ptr<const CacheMapping> _mapping;
 	QByteArray _data;
 	EncodeFields _encode;
+	std::shared_ptr<Recompression> _recompression;
 	QSize _size;
 	QSize _original;
 	CacheReadContext _readContext;
@@ -105,8 +212,12 @@ private:
 	int _frameRate = 0;
 	int _framesCount = 0;
 	int _framesReady = 0;
-	int _framesInData = 0;
-	Encoder _encoder = Encoder::YUV420A4_LZ4;
+	int _framesPut = 0;
+	int _generation = 0;
+	Encoder _encoder = Encoder::YUV420A4_LZ4_Indexed;
+	bool _paletteOverflow = false;
+	bool _backgroundRecompression = true;
+	bool _recompressed = false;
 	FnMut<void(QByteArray &&cached)> _put;
 
 };
@@ -6,131 +6,735 @@
 //
 #include "lottie/details/lottie_cache_frame_storage.h"
 
+#include "lottie/details/lottie_work_stealing.h"
 #include "base/assertion.h"
 
 #include <QtGui/QImage>
 #include <lz4.h>
 #include <lz4hc.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__) \
+	|| defined(_M_X64) \
+	|| (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOTTIE_SSE2
+#define LOTTIE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+#if defined __GNUC__ || defined __clang__
+#define LOTTIE_TARGET_AVX2 __attribute__((target("avx2")))
+#else // __GNUC__ || __clang__
+#define LOTTIE_TARGET_AVX2
+#endif // __GNUC__ || __clang__
+#endif // __SSE2__ || _M_X64 || _M_IX86_FP >= 2
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define LOTTIE_NEON
+#include <arm_neon.h>
+#endif // __ARM_NEON || _M_ARM64
 
 namespace Lottie {
 namespace {
 
 constexpr auto kAlignStorage = 16;
 
-void DecodeYUV2RGB(
-		QImage &to,
-		const EncodedStorage &from,
-		FFmpeg::SwscalePointer &context) {
-	context = FFmpeg::MakeSwscalePointer(
-		to.size(),
-		AV_PIX_FMT_YUV420P,
-		to.size(),
-		AV_PIX_FMT_BGRA,
-		&context);
-	Assert(context != nullptr);
-
-	// AV_NUM_DATA_POINTERS defined in AVFrame struct
-	const uint8_t *src[AV_NUM_DATA_POINTERS] = {
-		from.yData(),
-		from.uData(),
-		from.vData(),
-		nullptr
+// LZ4 matches reach at most 64 KB back, so a chunk together with its
+// dictionary (the same place of the previous frame with the margins)
+// must fit in that window.
+constexpr auto kDictionaryChunk = 16 * 1024;
+constexpr auto kDictionaryMargin = 16 * 1024;
+
+// Rows in a band of a banded frame, even for the chroma planes.
+constexpr auto kBandRows = 64;
+constexpr auto kBandParts = 4;
+
+[[nodiscard]] int BandsCount(int height) {
+	return (height + kBandRows - 1) / kBandRows;
+}
+
+// Y, U, V and A parts of a band of rows, each one is contiguous.
+template <typename Storage>
+[[nodiscard]] auto BandParts(Storage &&storage, int band) {
+	using Pointer = decltype(storage.yData());
+	struct Part {
+		Pointer data = nullptr;
+		int size = 0;
 	};
-	int srcLineSize[AV_NUM_DATA_POINTERS] = {
-		from.yBytesPerLine(),
-		from.uBytesPerLine(),
-		from.vBytesPerLine(),
-		0
+	const auto from = band * kBandRows;
+	const auto rows = std::min(kBandRows, storage.height() - from);
+	return std::array<Part, kBandParts>{ {
+		{
+			storage.yData() + from * storage.yBytesPerLine(),
+			rows * storage.yBytesPerLine(),
+		},
+		{
+			storage.uData() + (from / 2) * storage.uBytesPerLine(),
+			(rows / 2) * storage.uBytesPerLine(),
+		},
+		{
+			storage.vData() + (from / 2) * storage.vBytesPerLine(),
+			(rows / 2) * storage.vBytesPerLine(),
+		},
+		{
+			storage.aData() + from * storage.aBytesPerLine(),
+			rows * storage.aBytesPerLine(),
+		},
+	} };
+}
+
+struct DictionaryRange {
+	int start = 0;
+	int size = 0;
+};
+
+[[nodiscard]] int RectRowsSize(QRect rect) {
+	const auto half = rect.width() / 2;
+	return rect.width() * rect.height()
+		+ 2 * half * (rect.height() / 2)
+		+ half * rect.height();
+}
+
+// Calls method(plane, packed, rowBytes) for each row of the rect
+// in each plane, with 'packed' going through the rows one by one.
+template <typename Storage, typename Method>
+void EnumerateRectRows(Storage &&storage, QRect rect, Method &&method) {
+	const auto x = rect.x();
+	const auto y = rect.y();
+	const auto width = rect.width();
+	const auto height = rect.height();
+	auto packed = 0;
+	const auto plane = [&](
+			auto data,
+			int bytesPerLine,
+			int fromRow,
+			int rows,
+			int fromByte,
+			int bytes) {
+		for (auto row = fromRow; row != fromRow + rows; ++row) {
+			method(data + row * bytesPerLine + fromByte, packed, bytes);
+			packed += bytes;
+		}
 	};
-	uint8_t *dst[AV_NUM_DATA_POINTERS] = { to.bits(), nullptr };
-	int dstLineSize[AV_NUM_DATA_POINTERS] = { int(to.bytesPerLine()), 0 };
+	plane(storage.yData(), storage.yBytesPerLine(), y, height, x, width);
+	plane(
+		storage.uData(),
+		storage.uBytesPerLine(),
+		y / 2,
+		height / 2,
+		x / 2,
+		width / 2);
+	plane(
+		storage.vData(),
+		storage.vBytesPerLine(),
+		y / 2,
+		height / 2,
+		x / 2,
+		width / 2);
+	plane(
+		storage.aData(),
+		storage.aBytesPerLine(),
+		y,
+		height,
+		x / 2,
+		width / 2);
+}
 
-	sws_scale(
-		context.get(),
-		src,
-		srcLineSize,
-		0,
-		to.height(),
-		dst,
-		dstLineSize);
+[[nodiscard]] DictionaryRange DictionaryForChunk(
+		int start,
+		int chunk,
+		int total) {
+	const auto from = std::max(start - kDictionaryMargin, 0);
+	const auto till = std::min(start + chunk + kDictionaryMargin, total);
+	return { from, till - from };
 }
 
-void DecodeAlpha(QImage &to, const EncodedStorage &from) {
-	auto bytes = to.bits();
-	auto alpha = from.aData();
-	const auto perLine = to.bytesPerLine();
-	const auto width = to.width();
-	const auto height = to.height();
-	for (auto i = 0; i != height; ++i) {
-		auto ints = reinterpret_cast<uint32*>(bytes);
-		const auto till = ints + width;
-		while (ints != till) {
-			const auto value = uint32(*alpha++);
-			*ints = (*ints & 0x00FFFFFFU)
-				| ((value & 0xF0U) << 24)
-				| ((value & 0xF0U) << 20);
-			++ints;
-			*ints = (*ints & 0x00FFFFFFU)
-				| (value << 28)
-				| ((value & 0x0FU) << 24);
-			++ints;
+// Alpha is stored as 4 bit values, two neighbour pixels in a byte.
+void EncodeAlphaLine(uchar *alpha, const uint32 *ints, int width) {
+	for (const auto till = ints + width; ints != till; ints += 2) {
+		*alpha++ = ((ints[0] >> 24) & 0xF0U) | (ints[1] >> 28);
+	}
+}
+
+#ifdef LOTTIE_SSE2
+
+// Unpacks sixteen 4 bit alpha values to bytes with the pixels order.
+[[nodiscard]] __m128i UnpackAlphaSSE2(__m128i packed) {
+	const auto even = _mm_and_si128(packed, _mm_set1_epi8(char(0xF0)));
+	const auto odd = _mm_and_si128(packed, _mm_set1_epi8(0x0F));
+
+	// The masked nibbles don't leak to the neighbour bytes in shifts.
+	return _mm_unpacklo_epi8(
+		_mm_or_si128(even, _mm_srli_epi16(even, 4)),
+		_mm_or_si128(odd, _mm_slli_epi16(odd, 4)));
+}
+
+void EncodeAlphaLineSSE2(uchar *alpha, const uint32 *ints, int width) {
+	const auto even = _mm_set1_epi16(0x00F0);
+	const auto till = ints + (width & ~15);
+	for (; ints != till; ints += 16, alpha += 8) {
+		const auto from = reinterpret_cast<const __m128i*>(ints);
+		const auto load = [&](int index) {
+			return _mm_srli_epi32(_mm_loadu_si128(from + index), 24);
+		};
+		const auto alphas = _mm_packus_epi16(
+			_mm_packs_epi32(load(0), load(1)),
+			_mm_packs_epi32(load(2), load(3)));
+
+		// Each 16 bit lane has alpha values of two neighbour pixels.
+		const auto nibbles = _mm_or_si128(
+			_mm_and_si128(alphas, even),
+			_mm_srli_epi16(alphas, 12));
+		_mm_storel_epi64(
+			reinterpret_cast<__m128i*>(alpha),
+			_mm_packus_epi16(nibbles, nibbles));
+	}
+	EncodeAlphaLine(alpha, ints, width & 15);
+}
+
+#endif // LOTTIE_SSE2
+
+#ifdef LOTTIE_AVX2
+
+LOTTIE_TARGET_AVX2 void EncodeAlphaLineAVX2(
+		uchar *alpha,
+		const uint32 *ints,
+		int width) {
+	const auto even = _mm256_set1_epi16(0x00F0);
+	const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const auto till = ints + (width & ~31);
+	for (; ints != till; ints += 32, alpha += 16) {
+		const auto from = reinterpret_cast<const __m256i*>(ints);
+		const auto first = _mm256_srli_epi32(_mm256_loadu_si256(from), 24);
+		const auto second = _mm256_srli_epi32(
+			_mm256_loadu_si256(from + 1),
+			24);
+		const auto third = _mm256_srli_epi32(
+			_mm256_loadu_si256(from + 2),
+			24);
+		const auto fourth = _mm256_srli_epi32(
+			_mm256_loadu_si256(from + 3),
+			24);
+
+		// Packing works inside 128 bit lanes, restore the pixels order.
+		const auto alphas = _mm256_permutevar8x32_epi32(
+			_mm256_packus_epi16(
+				_mm256_packs_epi32(first, second),
+				_mm256_packs_epi32(third, fourth)),
+			order);
+		const auto nibbles = _mm256_or_si256(
+			_mm256_and_si256(alphas, even),
+			_mm256_srli_epi16(alphas, 12));
+		const auto packed = _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(nibbles, nibbles),
+			0x08);
+		_mm_storeu_si128(
+			reinterpret_cast<__m128i*>(alpha),
+			_mm256_castsi256_si128(packed));
+	}
+	EncodeAlphaLineSSE2(alpha, ints, width & 31);
+}
+
+#endif // LOTTIE_AVX2
+
+// BT.601 limited range, the same sws_scale used for YUV420P -> BGRA.
+// Coefficients are in 1/64 units, so that all the math fits int16,
+// luma is scaled by 74.5 / 64 with an additional half of the value.
+constexpr auto kYScale = 74;
+constexpr auto kRFromV = 102;
+constexpr auto kGFromU = 25;
+constexpr auto kGFromV = 52;
+constexpr auto kBFromU = 129;
+
+[[nodiscard]] inline uint32 Premultiply(uint32 component, uint32 alpha) {
+	const auto value = component * alpha + 128;
+	return (value + (value >> 8)) >> 8;
+}
+
+[[nodiscard]] inline uint32 ColorComponent(int value) {
+	return uint32(std::clamp((value + 32) >> 6, 0, 255));
+}
+
+void DecodeLine(
+		uint32 *to,
+		const uchar *y,
+		const uchar *u,
+		const uchar *v,
+		const uchar *alpha,
+		int width) {
+	for (auto i = 0; i != width; i += 2) {
+		const auto uvalue = int(*u++) - 128;
+		const auto vvalue = int(*v++) - 128;
+		const auto red = kRFromV * vvalue;
+		const auto green = -kGFromU * uvalue - kGFromV * vvalue;
+		const auto blue = kBFromU * uvalue;
+		const auto packed = uint32(*alpha++);
+		const uint32 alphas[] = {
+			(packed & 0xF0U) | (packed >> 4),
+			((packed & 0x0FU) << 4) | (packed & 0x0FU),
+		};
+		for (auto j = 0; j != 2; ++j) {
+			const auto value = int(*y++) - 16;
+			const auto luma = value * kYScale + (value >> 1);
+			const auto a = alphas[j];
+			*to++ = (a << 24)
+				| (Premultiply(ColorComponent(luma + red), a) << 16)
+				| (Premultiply(ColorComponent(luma + green), a) << 8)
+				| Premultiply(ColorComponent(luma + blue), a);
 		}
-		bytes += perLine;
 	}
 }
 
-void EncodeRGB2YUV(
-		EncodedStorage &to,
-		const QImage &from,
-		FFmpeg::SwscalePointer &context) {
-	context = FFmpeg::MakeSwscalePointer(
-		from.size(),
-		AV_PIX_FMT_BGRA,
-		from.size(),
-		AV_PIX_FMT_YUV420P,
-		&context);
-	Assert(context != nullptr);
-
-	// AV_NUM_DATA_POINTERS defined in AVFrame struct
-	const uint8_t *src[AV_NUM_DATA_POINTERS] = { from.bits(), nullptr };
-	int srcLineSize[AV_NUM_DATA_POINTERS] = { int(from.bytesPerLine()), 0 };
-	uint8_t *dst[AV_NUM_DATA_POINTERS] = {
-		to.yData(),
-		to.uData(),
-		to.vData(),
-		nullptr
+#ifdef LOTTIE_SSE2
+
+[[nodiscard]] inline __m128i LoadFour(const uchar *from) {
+	auto value = int32();
+	memcpy(&value, from, sizeof(value));
+	return _mm_cvtsi32_si128(value);
+}
+
+[[nodiscard]] inline __m128i ColorComponentSSE2(__m128i value) {
+	return _mm_min_epi16(
+		_mm_max_epi16(
+			_mm_srai_epi16(_mm_adds_epi16(value, _mm_set1_epi16(32)), 6),
+			_mm_setzero_si128()),
+		_mm_set1_epi16(255));
+}
+
+[[nodiscard]] inline __m128i PremultiplySSE2(
+		__m128i component,
+		__m128i alpha) {
+	// Products fit unsigned 16 bit, so only logical shifts are used.
+	const auto value = _mm_add_epi16(
+		_mm_mullo_epi16(component, alpha),
+		_mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(value, _mm_srli_epi16(value, 8)), 8);
+}
+
+void DecodeLineSSE2(
+		uint32 *to,
+		const uchar *y,
+		const uchar *u,
+		const uchar *v,
+		const uchar *alpha,
+		int width) {
+	const auto zero = _mm_setzero_si128();
+	const auto till = to + (width & ~7);
+	for (; to != till; to += 8, y += 8, u += 4, v += 4, alpha += 4) {
+		const auto value = _mm_sub_epi16(
+			_mm_unpacklo_epi8(
+				_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y)),
+				zero),
+			_mm_set1_epi16(16));
+		const auto luma = _mm_add_epi16(
+			_mm_mullo_epi16(value, _mm_set1_epi16(kYScale)),
+			_mm_srai_epi16(value, 1));
+		const auto chroma = [&](const uchar *from) {
+			const auto values = _mm_unpacklo_epi8(LoadFour(from), zero);
+			return _mm_sub_epi16(
+				_mm_unpacklo_epi16(values, values),
+				_mm_set1_epi16(128));
+		};
+		const auto uvalue = chroma(u);
+		const auto vvalue = chroma(v);
+		const auto alphas = _mm_unpacklo_epi8(
+			UnpackAlphaSSE2(LoadFour(alpha)),
+			zero);
+
+		const auto red = ColorComponentSSE2(_mm_adds_epi16(
+			luma,
+			_mm_mullo_epi16(vvalue, _mm_set1_epi16(kRFromV))));
+		const auto green = ColorComponentSSE2(_mm_subs_epi16(
+			_mm_subs_epi16(
+				luma,
+				_mm_mullo_epi16(uvalue, _mm_set1_epi16(kGFromU))),
+			_mm_mullo_epi16(vvalue, _mm_set1_epi16(kGFromV))));
+		const auto blue = ColorComponentSSE2(_mm_adds_epi16(
+			luma,
+			_mm_mullo_epi16(uvalue, _mm_set1_epi16(kBFromU))));
+
+		const auto blueGreen = _mm_or_si128(
+			PremultiplySSE2(blue, alphas),
+			_mm_slli_epi16(PremultiplySSE2(green, alphas), 8));
+		const auto redAlpha = _mm_or_si128(
+			PremultiplySSE2(red, alphas),
+			_mm_slli_epi16(alphas, 8));
+		const auto pixels = reinterpret_cast<__m128i*>(to);
+		_mm_storeu_si128(pixels, _mm_unpacklo_epi16(blueGreen, redAlpha));
+		_mm_storeu_si128(pixels + 1, _mm_unpackhi_epi16(blueGreen, redAlpha));
+	}
+	DecodeLine(to, y, u, v, alpha, width & 7);
+}
+
+#endif // LOTTIE_SSE2
+
+#ifdef LOTTIE_NEON
+
+[[nodiscard]] inline uint8x8_t LoadFourNEON(const uchar *from) {
+	auto value = uint32();
+	memcpy(&value, from, sizeof(value));
+	return vreinterpret_u8_u32(vdup_n_u32(value));
+}
+
+[[nodiscard]] inline uint16x8_t ColorComponentNEON(int16x8_t value) {
+	return vreinterpretq_u16_s16(vminq_s16(
+		vmaxq_s16(
+			vshrq_n_s16(vqaddq_s16(value, vdupq_n_s16(32)), 6),
+			vdupq_n_s16(0)),
+		vdupq_n_s16(255)));
+}
+
+[[nodiscard]] inline uint8x8_t PremultiplyNEON(
+		uint16x8_t component,
+		uint16x8_t alpha) {
+	const auto value = vmlaq_u16(vdupq_n_u16(128), component, alpha);
+	return vmovn_u16(vshrq_n_u16(vsraq_n_u16(value, value, 8), 8));
+}
+
+// The same math as DecodeLineSSE2(), pixels are stored interleaved.
+void DecodeLineNEON(
+		uint32 *to,
+		const uchar *y,
+		const uchar *u,
+		const uchar *v,
+		const uchar *alpha,
+		int width) {
+	const auto till = to + (width & ~7);
+	for (; to != till; to += 8, y += 8, u += 4, v += 4, alpha += 4) {
+		const auto value = vsubq_s16(
+			vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y))),
+			vdupq_n_s16(16));
+		const auto luma = vsraq_n_s16(
+			vmulq_n_s16(value, kYScale),
+			value,
+			1);
+		const auto chroma = [&](const uchar *from) {
+			const auto values = LoadFourNEON(from);
+			return vsubq_s16(
+				vreinterpretq_s16_u16(
+					vmovl_u8(vzip_u8(values, values).val[0])),
+				vdupq_n_s16(128));
+		};
+		const auto uvalue = chroma(u);
+		const auto vvalue = chroma(v);
+		const auto packed = LoadFourNEON(alpha);
+		const auto even = vand_u8(packed, vdup_n_u8(0xF0));
+		const auto odd = vand_u8(packed, vdup_n_u8(0x0F));
+		const auto alphas = vmovl_u8(vzip_u8(
+			vorr_u8(even, vshr_n_u8(even, 4)),
+			vorr_u8(odd, vshl_n_u8(odd, 4))).val[0]);
+
+		const auto red = ColorComponentNEON(vqaddq_s16(
+			luma,
+			vmulq_n_s16(vvalue, kRFromV)));
+		const auto green = ColorComponentNEON(vqsubq_s16(
+			vqsubq_s16(luma, vmulq_n_s16(uvalue, kGFromU)),
+			vmulq_n_s16(vvalue, kGFromV)));
+		const auto blue = ColorComponentNEON(vqaddq_s16(
+			luma,
+			vmulq_n_s16(uvalue, kBFromU)));
+
+		auto pixels = uint8x8x4_t();
+		pixels.val[0] = PremultiplyNEON(blue, alphas);
+		pixels.val[1] = PremultiplyNEON(green, alphas);
+		pixels.val[2] = PremultiplyNEON(red, alphas);
+		pixels.val[3] = vmovn_u16(alphas);
+		vst4_u8(reinterpret_cast<uint8_t*>(to), pixels);
+	}
+	DecodeLine(to, y, u, v, alpha, width & 7);
+}
+
+#endif // LOTTIE_NEON
+
+// BT.601 limited range, inverse of the decoding above.
+constexpr auto kYFromR = 0.256789f;
+constexpr auto kYFromG = 0.504129f;
+constexpr auto kYFromB = 0.0979062f;
+constexpr auto kUFromR = -0.148223f;
+constexpr auto kUFromG = -0.290992f;
+constexpr auto kUFromB = 0.439215f;
+constexpr auto kVFromR = 0.439215f;
+constexpr auto kVFromG = -0.367789f;
+constexpr auto kVFromB = -0.0714258f;
+
+// Two neighbour lines, sharing one line of chroma.
+struct EncodeLines {
+	const uint32 *from[2] = { nullptr };
+	uchar *y[2] = { nullptr };
+	uchar *u = nullptr;
+	uchar *v = nullptr;
+};
+
+[[nodiscard]] inline uchar EncodedComponent(float value) {
+	return uchar(std::clamp(int(std::nearbyint(value)), 0, 255));
+}
+
+// Colors are linear in the premultiplied values, so unpremultiplying
+// is a single multiplication by 255 / alpha of each of them.
+void EncodeLine(const EncodeLines &lines, int from, int till) {
+	for (auto x = from; x != till; x += 2) {
+		float u[2][2];
+		float v[2][2];
+		for (auto line = 0; line != 2; ++line) {
+			for (auto i = 0; i != 2; ++i) {
+				const auto pixel = lines.from[line][x + i];
+				const auto alpha = pixel >> 24;
+				const auto factor = alpha ? (255.f / float(alpha)) : 0.f;
+				const auto r = float((pixel >> 16) & 0xFFU);
+				const auto g = float((pixel >> 8) & 0xFFU);
+				const auto b = float(pixel & 0xFFU);
+				lines.y[line][x + i] = EncodedComponent(16.f
+					+ factor * (kYFromR * r + kYFromG * g + kYFromB * b));
+				u[line][i] = factor
+					* (kUFromR * r + kUFromG * g + kUFromB * b);
+				v[line][i] = factor
+					* (kVFromR * r + kVFromG * g + kVFromB * b);
+			}
+		}
+		lines.u[x / 2] = EncodedComponent(128.f
+			+ ((u[0][0] + u[1][0]) + (u[0][1] + u[1][1])) * 0.25f);
+		lines.v[x / 2] = EncodedComponent(128.f
+			+ ((v[0][0] + v[1][0]) + (v[0][1] + v[1][1])) * 0.25f);
+	}
+}
+
+#ifdef LOTTIE_SSE2
+
+struct EncodedPixelsSSE2 {
+	__m128i y;
+	__m128 u;
+	__m128 v;
+};
+
+[[nodiscard]] inline EncodedPixelsSSE2 EncodePixelsSSE2(const uint32 *from) {
+	const auto pixels = _mm_loadu_si128(
+		reinterpret_cast<const __m128i*>(from));
+	const auto mask = _mm_set1_epi32(0xFF);
+	const auto alpha = _mm_cvtepi32_ps(_mm_srli_epi32(pixels, 24));
+	const auto factor = _mm_and_ps(
+		_mm_div_ps(_mm_set1_ps(255.f), alpha),
+		_mm_cmpgt_ps(alpha, _mm_setzero_ps()));
+	const auto r = _mm_cvtepi32_ps(
+		_mm_and_si128(_mm_srli_epi32(pixels, 16), mask));
+	const auto g = _mm_cvtepi32_ps(
+		_mm_and_si128(_mm_srli_epi32(pixels, 8), mask));
+	const auto b = _mm_cvtepi32_ps(_mm_and_si128(pixels, mask));
+	const auto dot = [&](float fromR, float fromG, float fromB) {
+		return _mm_mul_ps(factor, _mm_add_ps(
+			_mm_add_ps(
+				_mm_mul_ps(_mm_set1_ps(fromR), r),
+				_mm_mul_ps(_mm_set1_ps(fromG), g)),
+			_mm_mul_ps(_mm_set1_ps(fromB), b)));
 	};
-	int dstLineSize[AV_NUM_DATA_POINTERS] = {
-		to.yBytesPerLine(),
-		to.uBytesPerLine(),
-		to.vBytesPerLine(),
-		0
+	return {
+		.y = _mm_cvtps_epi32(_mm_add_ps(
+			_mm_set1_ps(16.f),
+			dot(kYFromR, kYFromG, kYFromB))),
+		.u = dot(kUFromR, kUFromG, kUFromB),
+		.v = dot(kVFromR, kVFromG, kVFromB),
 	};
+}
 
-	sws_scale(
-		context.get(),
-		src,
-		srcLineSize,
-		0,
-		from.height(),
-		dst,
-		dstLineSize);
+// Sums the neighbour lanes: [a0 + a1, a2 + a3, b0 + b1, b2 + b3].
+[[nodiscard]] inline __m128 SumPairsSSE2(__m128 a, __m128 b) {
+	return _mm_add_ps(
+		_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+		_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
 }
 
-void EncodeAlpha(EncodedStorage &to, const QImage &from) {
-	auto bytes = from.bits();
-	auto alpha = to.aData();
-	const auto perLine = from.bytesPerLine();
-	const auto width = from.width();
-	const auto height = from.height();
-	for (auto i = 0; i != height; ++i) {
-		auto ints = reinterpret_cast<const uint32*>(bytes);
-		const auto till = ints + width;
-		for (; ints != till; ints += 2) {
-			*alpha++ = (((*ints) >> 24) & 0xF0U) | ((*(ints + 1)) >> 28);
+[[nodiscard]] inline int32 EncodeChromaSSE2(__m128 sums) {
+	const auto values = _mm_cvtps_epi32(_mm_add_ps(
+		_mm_set1_ps(128.f),
+		_mm_mul_ps(sums, _mm_set1_ps(0.25f))));
+	const auto words = _mm_packs_epi32(values, values);
+	return _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+}
+
+void EncodeLineSSE2(const EncodeLines &lines, int from, int till) {
+	auto x = from;
+	for (; x + 8 <= till; x += 8) {
+		EncodedPixelsSSE2 pixels[2][2];
+		for (auto line = 0; line != 2; ++line) {
+			pixels[line][0] = EncodePixelsSSE2(lines.from[line] + x);
+			pixels[line][1] = EncodePixelsSSE2(lines.from[line] + x + 4);
+			const auto words = _mm_packs_epi32(
+				pixels[line][0].y,
+				pixels[line][1].y);
+			_mm_storel_epi64(
+				reinterpret_cast<__m128i*>(lines.y[line] + x),
+				_mm_packus_epi16(words, words));
 		}
-		bytes += perLine;
+		const auto chroma = [&](__m128 EncodedPixelsSSE2::*field) {
+			return EncodeChromaSSE2(SumPairsSSE2(
+				_mm_add_ps(pixels[0][0].*field, pixels[1][0].*field),
+				_mm_add_ps(pixels[0][1].*field, pixels[1][1].*field)));
+		};
+		const auto u = chroma(&EncodedPixelsSSE2::u);
+		const auto v = chroma(&EncodedPixelsSSE2::v);
+		memcpy(lines.u + x / 2, &u, sizeof(u));
+		memcpy(lines.v + x / 2, &v, sizeof(v));
 	}
+	EncodeLine(lines, x, till);
+}
+
+#endif // LOTTIE_SSE2
+
+void XorBytes(uchar *to, const uchar *from, int amount) {
+	using Block = std::conditional_t<
+		sizeof(void*) == sizeof(uint64),
+		uint64,
+		uint32>;
+	constexpr auto kBlockSize = int(sizeof(Block));
+	const auto blocks = amount / kBlockSize;
+	for (auto i = 0; i != blocks; ++i) {
+		auto block = Block();
+		auto other = Block();
+		memcpy(&block, to + i * kBlockSize, kBlockSize);
+		memcpy(&other, from + i * kBlockSize, kBlockSize);
+		block ^= other;
+		memcpy(to + i * kBlockSize, &block, kBlockSize);
+	}
+	for (auto i = blocks * kBlockSize; i != amount; ++i) {
+		to[i] ^= from[i];
+	}
+}
+
+#ifdef LOTTIE_SSE2
+
+void XorBytesSSE2(uchar *to, const uchar *from, int amount) {
+	const auto blocks = amount / 64;
+	auto destination = reinterpret_cast<__m128i*>(to);
+	auto source = reinterpret_cast<const __m128i*>(from);
+	for (auto i = 0; i != blocks; ++i, destination += 4, source += 4) {
+		for (auto j = 0; j != 4; ++j) {
+			_mm_storeu_si128(destination + j, _mm_xor_si128(
+				_mm_loadu_si128(destination + j),
+				_mm_loadu_si128(source + j)));
+		}
+	}
+	XorBytes(to + blocks * 64, from + blocks * 64, amount - blocks * 64);
+}
+
+#endif // LOTTIE_SSE2
+
+#ifdef LOTTIE_AVX2
+
+LOTTIE_TARGET_AVX2 void XorBytesAVX2(
+		uchar *to,
+		const uchar *from,
+		int amount) {
+	const auto blocks = amount / 128;
+	auto destination = reinterpret_cast<__m256i*>(to);
+	auto source = reinterpret_cast<const __m256i*>(from);
+	for (auto i = 0; i != blocks; ++i, destination += 4, source += 4) {
+		for (auto j = 0; j != 4; ++j) {
+			_mm256_storeu_si256(destination + j, _mm256_xor_si256(
+				_mm256_loadu_si256(destination + j),
+				_mm256_loadu_si256(source + j)));
+		}
+	}
+	XorBytesSSE2(
+		to + blocks * 128,
+		from + blocks * 128,
+		amount - blocks * 128);
+}
+
+#endif // LOTTIE_AVX2
+
+enum class SimdLevel {
+	None,
+	SSE2,
+	AVX2,
+};
+
+[[nodiscard]] SimdLevel DetectSimdLevel() {
+#ifdef LOTTIE_AVX2
+#ifdef _MSC_VER
+	auto info = std::array<int, 4>();
+	__cpuid(info.data(), 0);
+	if (info[0] >= 7) {
+		__cpuid(info.data(), 1);
+		const auto osxsave = (info[2] & (1 << 27)) != 0;
+		const auto avx = (info[2] & (1 << 28)) != 0;
+		if (osxsave && avx && (_xgetbv(0) & 0x06) == 0x06) {
+			__cpuidex(info.data(), 7, 0);
+			if (info[1] & (1 << 5)) {
+				return SimdLevel::AVX2;
+			}
+		}
+	}
+#else // _MSC_VER
+	if (__builtin_cpu_supports("avx2")) {
+		return SimdLevel::AVX2;
+	}
+#endif // _MSC_VER
+#endif // LOTTIE_AVX2
+#ifdef LOTTIE_SSE2
+	return SimdLevel::SSE2;
+#else // LOTTIE_SSE2
+	return SimdLevel::None;
+#endif // LOTTIE_SSE2
+}
+
+[[nodiscard]] SimdLevel CurrentSimdLevel() {
+	static const auto result = DetectSimdLevel();
+	return result;
+}
+
+[[nodiscard]] auto DecodeLineKernel() {
+#ifdef LOTTIE_SSE2
+	if (CurrentSimdLevel() >= SimdLevel::SSE2) {
+		return DecodeLineSSE2;
+	}
+#endif // LOTTIE_SSE2
+#ifdef LOTTIE_NEON
+	// NEON is always there on the targets it is compiled for.
+	return DecodeLineNEON;
+#else // LOTTIE_NEON
+	return DecodeLine;
+#endif // LOTTIE_NEON
+}
+
+[[nodiscard]] auto EncodeLineKernel() {
+#ifdef LOTTIE_SSE2
+	if (CurrentSimdLevel() >= SimdLevel::SSE2) {
+		return EncodeLineSSE2;
+	}
+#endif // LOTTIE_SSE2
+	return EncodeLine;
+}
+
+[[nodiscard]] auto XorBytesKernel() {
+#ifdef LOTTIE_AVX2
+	if (CurrentSimdLevel() >= SimdLevel::AVX2) {
+		return XorBytesAVX2;
+	}
+#endif // LOTTIE_AVX2
+#ifdef LOTTIE_SSE2
+	if (CurrentSimdLevel() >= SimdLevel::SSE2) {
+		return XorBytesSSE2;
+	}
+#endif // LOTTIE_SSE2
+	return XorBytes;
+}
+
+[[nodiscard]] auto EncodeAlphaLineKernel() {
+#ifdef LOTTIE_AVX2
+	if (CurrentSimdLevel() >= SimdLevel::AVX2) {
+		return EncodeAlphaLineAVX2;
+	}
+#endif // LOTTIE_AVX2
+#ifdef LOTTIE_SSE2
+	if (CurrentSimdLevel() >= SimdLevel::SSE2) {
+		return EncodeAlphaLineSSE2;
+	}
+#endif // LOTTIE_SSE2
+	return EncodeAlphaLine;
 }
 
 int YLineSize(int width) {
@@ -158,20 +762,34 @@ int ASize(int width, int height) {
 void EncodedStorage::allocate(int width, int height) {
 	Expects((width % 2) == 0 && (height % 2) == 0);
 
-	if (YSize(width, height) != YSize(_width, _height)
+	if (_singlePlane
+		|| YSize(width, height) != YSize(_width, _height)
 		|| UVSize(width, height) != UVSize(_width, _height)
 		|| ASize(width, height) != ASize(_width, _height)) {
 		_width = width;
 		_height = height;
+		_singlePlane = false;
+		reallocate();
+	}
+}
+
+void EncodedStorage::allocatePlane(int width, int height) {
+	Expects((width % 2) == 0 && (height % 2) == 0);
+
+	if (!_singlePlane || YSize(width, height) != YSize(_width, _height)) {
+		_width = width;
+		_height = height;
+		_singlePlane = true;
 		reallocate();
 	}
 }
 
+bool EncodedStorage::singlePlane() const {
+	return _singlePlane;
+}
+
 void EncodedStorage::reallocate() {
-	const auto total = YSize(_width, _height)
-		+ 2 * UVSize(_width, _height)
-		+ ASize(_width, _height);
-	_data = QByteArray(total + kAlignStorage - 1, 0);
+	_data = QByteArray(size() + kAlignStorage - 1, 0);
 }
 
 int EncodedStorage::width() const {
@@ -183,9 +801,11 @@ int EncodedStorage::height() const {
 }
 
 int EncodedStorage::size() const {
-	return YSize(_width, _height)
-		+ 2 * UVSize(_width, _height)
-		+ ASize(_width, _height);
+	return _singlePlane
+		? YSize(_width, _height)
+		: (YSize(_width, _height)
+			+ 2 * UVSize(_width, _height)
+			+ ASize(_width, _height));
 }
 
 char *EncodedStorage::data() {
@@ -251,61 +871,323 @@ int EncodedStorage::aBytesPerLine() const {
 void Xor(EncodedStorage &to, const EncodedStorage &from) {
 	Expects(to.size() == from.size());
 
-	using Block = std::conditional_t<
-		sizeof(void*) == sizeof(uint64),
-		uint64,
-		uint32>;
-	constexpr auto kBlockSize = sizeof(Block);
-	const auto amount = from.size();
-	const auto fromBytes = reinterpret_cast<const uchar*>(from.data());
-	const auto toBytes = reinterpret_cast<uchar*>(to.data());
-	const auto blocks = amount / kBlockSize;
-	const auto fromBlocks = reinterpret_cast<const Block*>(fromBytes);
-	const auto toBlocks = reinterpret_cast<Block*>(toBytes);
-	for (auto i = 0; i != blocks; ++i) {
-		toBlocks[i] ^= fromBlocks[i];
+	const auto kernel = XorBytesKernel();
+	kernel(
+		reinterpret_cast<uchar*>(to.data()),
+		reinterpret_cast<const uchar*>(from.data()),
+		from.size());
+}
+
+void Encode(EncodedStorage &to, const QImage &from) {
+	Expects(from.width() == to.width() && from.height() == to.height());
+
+	// Unpremultiplies, converts colors and packs alpha in a single sweep
+	// through each pair of lines, without an intermediate image.
+	const auto line = EncodeLineKernel();
+	const auto alpha = EncodeAlphaLineKernel();
+	auto bytes = from.bits();
+	const auto perLine = from.bytesPerLine();
+	const auto width = from.width();
+	const auto height = from.height();
+	for (auto i = 0; i != height; i += 2) {
+		const auto lines = EncodeLines{
+			.from = {
+				reinterpret_cast<const uint32*>(bytes),
+				reinterpret_cast<const uint32*>(bytes + perLine),
+			},
+			.y = {
+				to.yData() + i * to.yBytesPerLine(),
+				to.yData() + (i + 1) * to.yBytesPerLine(),
+			},
+			.u = to.uData() + (i / 2) * to.uBytesPerLine(),
+			.v = to.vData() + (i / 2) * to.vBytesPerLine(),
+		};
+		line(lines, 0, width);
+		alpha(to.aData() + i * to.aBytesPerLine(), lines.from[0], width);
+		alpha(
+			to.aData() + (i + 1) * to.aBytesPerLine(),
+			lines.from[1],
+			width);
+		bytes += 2 * perLine;
+	}
+}
+
+void Decode(
+		QImage &to,
+		const EncodedStorage &from,
+		const QSize &fromSize,
+		int threads) {
+	if (!FFmpeg::GoodStorageForFrame(to, fromSize)) {
+		to = FFmpeg::CreateFrameStorage(fromSize);
+	}
+
+	// Converts colors, adds alpha and premultiplies in a single pass.
+	const auto line = DecodeLineKernel();
+	const auto bits = to.bits();
+	const auto perLine = to.bytesPerLine();
+	const auto width = fromSize.width();
+	const auto height = fromSize.height();
+	const auto decodeRows = [&](int band) {
+		const auto till = std::min((band + 1) * kBandRows, height);
+		for (auto i = band * kBandRows; i != till; ++i) {
+			line(
+				reinterpret_cast<uint32*>(bits + i * perLine),
+				from.yData() + i * from.yBytesPerLine(),
+				from.uData() + (i / 2) * from.uBytesPerLine(),
+				from.vData() + (i / 2) * from.vBytesPerLine(),
+				from.aData() + i * from.aBytesPerLine(),
+				width);
+		}
+	};
+	const auto bands = BandsCount(height);
+	if (threads > 1 && bands > 1) {
+		RunWorkStealing(bands, threads, decodeRows);
+	} else {
+		for (auto band = 0; band != bands; ++band) {
+			decodeRows(band);
+		}
+	}
+}
+
+void EncodeAlpha(EncodedStorage &to, const QImage &from) {
+	Expects(to.singlePlane());
+	Expects(from.width() == to.width() && from.height() == to.height());
+
+	const auto width = to.width();
+	const auto height = to.height();
+	auto bytes = from.bits();
+	const auto perLine = from.bytesPerLine();
+	for (auto i = 0; i != height; ++i) {
+		const auto ints = reinterpret_cast<const uint32*>(bytes);
+		const auto alpha = to.yData() + i * to.yBytesPerLine();
+		for (auto x = 0; x != width; ++x) {
+			alpha[x] = uchar(ints[x] >> 24);
+		}
+		bytes += perLine;
+	}
+}
+
+void DecodeAlpha(
+		QImage &to,
+		const EncodedStorage &from,
+		const QSize &fromSize,
+		QColor color) {
+	Expects(from.singlePlane());
+
+	if (!FFmpeg::GoodStorageForFrame(to, fromSize)) {
+		to = FFmpeg::CreateFrameStorage(fromSize);
+	}
+
+	// Opaque color with the stored alpha, premultiplied. The requested
+	// color alpha is still applied when the frame is prepared.
+	auto table = std::array<uint32, 256>();
+	const auto red = uint32(color.red());
+	const auto green = uint32(color.green());
+	const auto blue = uint32(color.blue());
+	for (auto alpha = uint32(0); alpha != 256; ++alpha) {
+		table[alpha] = (alpha << 24)
+			| (Premultiply(red, alpha) << 16)
+			| (Premultiply(green, alpha) << 8)
+			| Premultiply(blue, alpha);
+	}
+	auto bytes = to.bits();
+	const auto perLine = to.bytesPerLine();
+	const auto width = fromSize.width();
+	const auto height = fromSize.height();
+	for (auto i = 0; i != height; ++i) {
+		const auto ints = reinterpret_cast<uint32*>(bytes);
+		const auto alpha = from.yData() + i * from.yBytesPerLine();
+		for (auto x = 0; x != width; ++x) {
+			ints[x] = table[alpha[x]];
+		}
+		bytes += perLine;
+	}
+}
+
+FramePalette::FramePalette() {
+	clear();
+}
+
+int FramePalette::index(uint32 color) {
+	constexpr auto kMask = (1 << kTableBits) - 1;
+	auto slot = int((color * 0x9E3779B1U) >> (32 - kTableBits));
+	while (true) {
+		const auto index = _table[slot];
+		if (index < 0) {
+			const auto result = int(_colors.size());
+			if (result == kMaxColors) {
+				return -1;
+			}
+			_table[slot] = int16(result);
+			_colors.push_back(color);
+			return result;
+		} else if (_colors[index] == color) {
+			return index;
+		}
+		slot = (slot + 1) & kMask;
+	}
+}
+
+int FramePalette::size() const {
+	return int(_colors.size());
+}
+
+const std::vector<uint32> &FramePalette::colors() const {
+	return _colors;
+}
+
+void FramePalette::clear() {
+	_colors.clear();
+	_table.fill(-1);
+}
+
+void FramePalette::write(QByteArray &to, int from) const {
+	Expects(to.size() >= int(sizeof(qint32)));
+	Expects(from >= 0 && from <= size());
+
+	const auto count = qint32(size());
+	const auto first = qint32(from);
+	const auto colors = (count - first) * int(sizeof(uint32));
+	const auto added = int(2 * sizeof(qint32)) + colors;
+	auto part = QByteArray(added, Qt::Uninitialized);
+	memcpy(part.data(), &count, sizeof(qint32));
+	memcpy(part.data() + sizeof(qint32), &first, sizeof(qint32));
+	if (colors > 0) {
+		memcpy(
+			part.data() + 2 * sizeof(qint32),
+			_colors.data() + first,
+			colors);
+	}
+	to.insert(sizeof(qint32), part);
+
+	// The length keeps its sign, negative for XOR-d frames.
+	auto length = qint32(0);
+	memcpy(&length, to.constData(), sizeof(qint32));
+	length = (length < 0) ? (length - added) : (length + added);
+	memcpy(to.data(), &length, sizeof(qint32));
+}
+
+int FramePalette::read(bytes::const_span from) {
+	auto count = qint32(0);
+	auto first = qint32(0);
+	if (from.size() < 2 * sizeof(qint32)) {
+		return -1;
+	}
+	memcpy(&count, from.data(), sizeof(qint32));
+	memcpy(&first, from.data() + sizeof(qint32), sizeof(qint32));
+	const auto colors = from.subspan(2 * sizeof(qint32));
+	if (count < 0
+		|| count > kMaxColors
+		|| first < 0
+		|| first > count
+		|| colors.size() < (count - first) * sizeof(uint32)) {
+		return -1;
+	} else if (!first) {
+		// Keyframe after a seek, the colors we have may be unrelated.
+		clear();
+	} else if (first > size()) {
+		return -1;
 	}
-	const auto left = amount - (blocks * kBlockSize);
-	for (auto i = amount - left; i != amount; ++i) {
-		toBytes[i] ^= fromBytes[i];
+	for (auto i = size(); i < count; ++i) {
+		auto color = uint32(0);
+		memcpy(
+			&color,
+			colors.data() + (i - first) * sizeof(uint32),
+			sizeof(uint32));
+		if (index(color) != i) {
+			return -1;
+		}
 	}
+	return int(2 * sizeof(qint32) + (count - first) * sizeof(uint32));
 }
 
-void Encode(
+bool EncodePalette(
 		EncodedStorage &to,
 		const QImage &from,
-		QImage &cache,
-		FFmpeg::SwscalePointer &context) {
-	FFmpeg::UnPremultiply(cache, from);
-	EncodeRGB2YUV(to, cache, context);
-	EncodeAlpha(to, cache);
+		FramePalette &palette) {
+	Expects(to.singlePlane());
+	Expects(from.width() == to.width() && from.height() == to.height());
+
+	const auto width = to.width();
+	const auto height = to.height();
+	auto bytes = from.bits();
+	const auto perLine = from.bytesPerLine();
+
+	// Flat fills give long runs of the same color.
+	auto last = uint32(0);
+	auto lastIndex = palette.index(last);
+	if (lastIndex < 0) {
+		return false;
+	}
+	for (auto i = 0; i != height; ++i) {
+		const auto ints = reinterpret_cast<const uint32*>(bytes);
+		const auto indices = to.yData() + i * to.yBytesPerLine();
+		for (auto x = 0; x != width; ++x) {
+			if (ints[x] != last) {
+				last = ints[x];
+				lastIndex = palette.index(last);
+				if (lastIndex < 0) {
+					return false;
+				}
+			}
+			indices[x] = uchar(lastIndex);
+		}
+		bytes += perLine;
+	}
+	return true;
 }
 
-void Decode(
+void DecodePalette(
 		QImage &to,
 		const EncodedStorage &from,
 		const QSize &fromSize,
-		FFmpeg::SwscalePointer &context) {
+		const FramePalette &palette) {
+	Expects(from.singlePlane());
+
 	if (!FFmpeg::GoodStorageForFrame(to, fromSize)) {
 		to = FFmpeg::CreateFrameStorage(fromSize);
 	}
-	DecodeYUV2RGB(to, from, context);
-	DecodeAlpha(to, from);
-	FFmpeg::PremultiplyInplace(to);
+
+	// Indices past the palette are only in broken data.
+	auto table = std::array<uint32, FramePalette::kMaxColors>();
+	const auto &colors = palette.colors();
+	std::copy(begin(colors), end(colors), begin(table));
+	auto bytes = to.bits();
+	const auto perLine = to.bytesPerLine();
+	const auto width = fromSize.width();
+	const auto height = fromSize.height();
+	for (auto i = 0; i != height; ++i) {
+		const auto ints = reinterpret_cast<uint32*>(bytes);
+		const auto indices = from.yData() + i * from.yBytesPerLine();
+		for (auto x = 0; x != width; ++x) {
+			ints[x] = table[indices[x]];
+		}
+		bytes += perLine;
+	}
 }
 
-void CompressFromRaw(QByteArray &to, const EncodedStorage &from) {
+void CompressFromRaw(
+		QByteArray &to,
+		const EncodedStorage &from,
+		bool high) {
 	const auto size = from.size();
 	const auto max = sizeof(qint32) + LZ4_compressBound(size);
 	to.reserve(max);
 	to.resize(max);
-	const auto compressed = LZ4_compress_default(
-		from.data(),
-		to.data() + sizeof(qint32),
-		size,
-		to.size() - sizeof(qint32));
+	const auto compressed = high
+		? LZ4_compress_HC(
+			from.data(),
+			to.data() + sizeof(qint32),
+			size,
+			to.size() - sizeof(qint32),
+			LZ4HC_CLEVEL_DEFAULT)
+		: LZ4_compress_default(
+			from.data(),
+			to.data() + sizeof(qint32),
+			size,
+			to.size() - sizeof(qint32));
 	Assert(compressed > 0);
-	if (compressed >= size + sizeof(qint32)) {
+	if (compressed >= size + int(sizeof(qint32))) {
 		to.resize(size + sizeof(qint32));
 		memcpy(to.data() + sizeof(qint32), from.data(), size);
 	} else {
@@ -343,10 +1225,329 @@ void CompressAndSwapFrame(
 		bytes::object_as_span(&negativeLength));
 }
 
+void CompressWithPrevious(
+		QByteArray &to,
+		const EncodedStorage &frame,
+		const EncodedStorage &previous,
+		bool high) {
+	Expects(frame.size() == previous.size());
+
+	const auto size = frame.size();
+	const auto chunks = (size + kDictionaryChunk - 1) / kDictionaryChunk;
+	const auto max = sizeof(qint32)
+		+ chunks * (sizeof(qint32) + LZ4_compressBound(kDictionaryChunk));
+	to.reserve(max);
+	to.resize(max);
+
+	auto fast = std::unique_ptr<LZ4_stream_t, decltype(&LZ4_freeStream)>(
+		high ? nullptr : LZ4_createStream(),
+		&LZ4_freeStream);
+	auto hc = std::unique_ptr<LZ4_streamHC_t, decltype(&LZ4_freeStreamHC)>(
+		high ? LZ4_createStreamHC() : nullptr,
+		&LZ4_freeStreamHC);
+	Assert(fast || hc);
+
+	auto offset = int(sizeof(qint32));
+	for (auto start = 0; start < size; start += kDictionaryChunk) {
+		const auto chunk = std::min(kDictionaryChunk, size - start);
+		const auto dictionary = DictionaryForChunk(start, chunk, size);
+		const auto dictionaryData = previous.data() + dictionary.start;
+		const auto source = frame.data() + start;
+		const auto destination = to.data() + offset + sizeof(qint32);
+		const auto capacity = int(to.size() - offset - sizeof(qint32));
+		auto compressed = 0;
+		if (hc) {
+			LZ4_resetStreamHC_fast(hc.get(), LZ4HC_CLEVEL_DEFAULT);
+			LZ4_loadDictHC(hc.get(), dictionaryData, dictionary.size);
+			compressed = LZ4_compress_HC_continue(
+				hc.get(),
+				source,
+				destination,
+				chunk,
+				capacity);
+		} else {
+			LZ4_loadDict(fast.get(), dictionaryData, dictionary.size);
+			compressed = LZ4_compress_fast_continue(
+				fast.get(),
+				source,
+				destination,
+				chunk,
+				capacity,
+				1);
+		}
+		Assert(compressed > 0);
+
+		// Chunk length equal to the chunk size means it is not compressed.
+		if (compressed >= chunk) {
+			memcpy(destination, source, chunk);
+			compressed = chunk;
+		}
+		const auto length = qint32(compressed);
+		memcpy(to.data() + offset, &length, sizeof(qint32));
+		offset += sizeof(qint32) + compressed;
+	}
+	to.resize(offset);
+
+	// Negative length means the frame depends on the previous one.
+	const auto negativeLength = -qint32(to.size() - sizeof(qint32));
+	bytes::copy(
+		bytes::make_detached_span(to),
+		bytes::object_as_span(&negativeLength));
+}
+
+QRect ChangedRect(
+		const EncodedStorage &frame,
+		const EncodedStorage &previous) {
+	Expects(frame.width() == previous.width());
+	Expects(frame.height() == previous.height());
+
+	// Bounds in 2x2 blocks.
+	auto left = frame.width() / 2;
+	auto right = -1;
+	auto top = frame.height() / 2;
+	auto bottom = -1;
+	const auto scan = [&](
+			const uint8_t *a,
+			const uint8_t *b,
+			int bytesPerLine,
+			int rows,
+			int bytes,
+			int columnShift,
+			int rowShift) {
+		for (auto row = 0; row != rows; ++row) {
+			const auto first = a + row * bytesPerLine;
+			const auto second = b + row * bytesPerLine;
+			if (!memcmp(first, second, bytes)) {
+				continue;
+			}
+			auto from = 0;
+			while (first[from] == second[from]) {
+				++from;
+			}
+			auto till = bytes - 1;
+			while (first[till] == second[till]) {
+				--till;
+			}
+			left = std::min(left, from >> columnShift);
+			right = std::max(right, till >> columnShift);
+			top = std::min(top, row >> rowShift);
+			bottom = std::max(bottom, row >> rowShift);
+		}
+	};
+	const auto width = frame.width();
+	const auto height = frame.height();
+	scan(
+		frame.yData(),
+		previous.yData(),
+		frame.yBytesPerLine(),
+		height,
+		width,
+		1,
+		1);
+	scan(
+		frame.uData(),
+		previous.uData(),
+		frame.uBytesPerLine(),
+		height / 2,
+		width / 2,
+		0,
+		0);
+	scan(
+		frame.vData(),
+		previous.vData(),
+		frame.vBytesPerLine(),
+		height / 2,
+		width / 2,
+		0,
+		0);
+	scan(
+		frame.aData(),
+		previous.aData(),
+		frame.aBytesPerLine(),
+		height,
+		width / 2,
+		0,
+		1);
+	return (right < left)
+		? QRect()
+		: QRect(
+			left * 2,
+			top * 2,
+			(right - left + 1) * 2,
+			(bottom - top + 1) * 2);
+}
+
+void CompressRectDelta(
+		QByteArray &to,
+		EncodedStorage &rows,
+		const EncodedStorage &frame,
+		const EncodedStorage &previous) {
+	const auto rect = ChangedRect(frame, previous);
+	const auto xorBytes = XorBytesKernel();
+	const auto packed = reinterpret_cast<uchar*>(rows.data());
+	EnumerateRectRows(frame, rect, [&](
+			const uint8_t *data,
+			int offset,
+			int bytes) {
+		memcpy(packed + offset, data, bytes);
+	});
+	EnumerateRectRows(previous, rect, [&](
+			const uint8_t *data,
+			int offset,
+			int bytes) {
+		xorBytes(packed + offset, data, bytes);
+	});
+	CompressRectRows(to, rows, rect);
+
+	// Negative length means the frame depends on the previous one.
+	const auto negativeLength = -qint32(to.size() - sizeof(qint32));
+	bytes::copy(
+		bytes::make_detached_span(to),
+		bytes::object_as_span(&negativeLength));
+}
+
+void CompressRectRows(
+		QByteArray &to,
+		const EncodedStorage &rows,
+		QRect rect,
+		bool high) {
+	const auto size = RectRowsSize(rect);
+	Assert(size <= rows.size());
+
+	// Length, x, y, width, height and the rows block.
+	const auto header = 5 * int(sizeof(qint32));
+	const auto max = header + (size ? LZ4_compressBound(size) : 0);
+	to.reserve(max);
+	to.resize(max);
+	const auto values = std::array<qint32, 5>{
+		0,
+		rect.x(),
+		rect.y(),
+		rect.width(),
+		rect.height(),
+	};
+	memcpy(to.data(), values.data(), header);
+	if (!size) {
+		to.resize(header);
+	} else {
+		const auto compressed = high
+			? LZ4_compress_HC(
+				rows.data(),
+				to.data() + header,
+				size,
+				to.size() - header,
+				LZ4HC_CLEVEL_DEFAULT)
+			: LZ4_compress_default(
+				rows.data(),
+				to.data() + header,
+				size,
+				to.size() - header);
+		Assert(compressed > 0);
+
+		// Block size equal to the rows size means it is not compressed.
+		if (compressed >= size) {
+			memcpy(to.data() + header, rows.data(), size);
+			to.resize(header + size);
+		} else {
+			to.resize(header + compressed);
+		}
+	}
+	const auto length = qint32(to.size() - sizeof(qint32));
+	bytes::copy(
+		bytes::make_detached_span(to),
+		bytes::object_as_span(&length));
+}
+
+void XorRect(EncodedStorage &to, const EncodedStorage &rows, QRect rect) {
+	const auto xorBytes = XorBytesKernel();
+	const auto packed = reinterpret_cast<const uchar*>(rows.data());
+	EnumerateRectRows(to, rect, [&](uint8_t *data, int offset, int bytes) {
+		xorBytes(data, packed + offset, bytes);
+	});
+}
+
+void CompressBands(
+		QByteArray &to,
+		const EncodedStorage &from,
+		bool delta,
+		int threads,
+		bool high) {
+	const auto bands = BandsCount(from.height());
+	const auto lengths = bands * kBandParts;
+	auto compressed = std::vector<QByteArray>(bands);
+	auto sizes = std::vector<qint32>(lengths);
+	const auto compressBand = [&](int band) {
+		const auto parts = BandParts(from, band);
+		auto &result = compressed[band];
+		auto max = 0;
+		for (const auto &part : parts) {
+			max += LZ4_compressBound(part.size);
+		}
+		result.resize(max);
+		auto offset = 0;
+		for (auto i = 0; i != kBandParts; ++i) {
+			const auto source = reinterpret_cast<const char*>(parts[i].data);
+			const auto size = parts[i].size;
+			const auto destination = result.data() + offset;
+			const auto capacity = int(result.size() - offset);
+			auto length = !size
+				? 0
+				: high
+				? LZ4_compress_HC(
+					source,
+					destination,
+					size,
+					capacity,
+					LZ4HC_CLEVEL_DEFAULT)
+				: LZ4_compress_default(source, destination, size, capacity);
+			Assert(length > 0 || !size);
+
+			// Part length equal to the part size means it is not compressed.
+			if (length >= size) {
+				memcpy(destination, source, size);
+				length = size;
+			}
+			sizes[band * kBandParts + i] = length;
+			offset += length;
+		}
+		result.resize(offset);
+	};
+	if (threads > 1 && bands > 1) {
+		RunWorkStealing(bands, threads, compressBand);
+	} else {
+		for (auto band = 0; band != bands; ++band) {
+			compressBand(band);
+		}
+	}
+
+	// Length, bands count, parts lengths and the parts.
+	const auto header = int(sizeof(qint32)) * (2 + lengths);
+	auto size = header;
+	for (const auto &band : compressed) {
+		size += band.size();
+	}
+	to.resize(size);
+	const auto length = qint32(to.size() - sizeof(qint32));
+	const auto values = std::array<qint32, 2>{
+		delta ? -length : length,
+		qint32(bands),
+	};
+	memcpy(to.data(), values.data(), sizeof(values));
+	memcpy(
+		to.data() + sizeof(values),
+		sizes.data(),
+		lengths * sizeof(qint32));
+	auto offset = header;
+	for (const auto &band : compressed) {
+		memcpy(to.data() + offset, band.constData(), band.size());
+		offset += band.size();
+	}
+}
+
 bool UncompressToRaw(EncodedStorage &to, bytes::const_span from) {
-	if (from.empty() || from.size() > to.size()) {
+	if (from.empty() || int(from.size()) > to.size()) {
 		return false;
-	} else if (from.size() == to.size()) {
+	} else if (int(from.size()) == to.size()) {
 		memcpy(to.data(), from.data(), from.size());
 		return true;
 	}
@@ -358,4 +1559,155 @@ bool UncompressToRaw(EncodedStorage &to, bytes::const_span from) {
 	return (result == to.size());
 }
 
+bool UncompressWithPrevious(
+		EncodedStorage &to,
+		bytes::const_span from,
+		const EncodedStorage &previous) {
+	Expects(to.size() == previous.size());
+
+	const auto size = to.size();
+	for (auto start = 0; start < size; start += kDictionaryChunk) {
+		const auto chunk = std::min(kDictionaryChunk, size - start);
+		auto length = qint32(0);
+		if (from.size() < sizeof(length)) {
+			return false;
+		}
+		bytes::copy(
+			bytes::object_as_span(&length),
+			from.subspan(0, sizeof(length)));
+		from = from.subspan(sizeof(length));
+		if (length <= 0 || length > chunk || length > int(from.size())) {
+			return false;
+		} else if (length == chunk) {
+			memcpy(to.data() + start, from.data(), chunk);
+		} else {
+			const auto dictionary = DictionaryForChunk(start, chunk, size);
+			const auto result = LZ4_decompress_safe_usingDict(
+				reinterpret_cast<const char*>(from.data()),
+				to.data() + start,
+				length,
+				chunk,
+				previous.data() + dictionary.start,
+				dictionary.size);
+			if (result != chunk) {
+				return false;
+			}
+		}
+		from = from.subspan(length);
+	}
+	return from.empty();
+}
+
+bool UncompressRectDelta(
+		EncodedStorage &rows,
+		bytes::const_span from,
+		QRect &rect) {
+	auto values = std::array<qint32, 4>();
+	const auto header = values.size() * sizeof(qint32);
+	if (from.size() < header) {
+		return false;
+	}
+	memcpy(values.data(), from.data(), header);
+	from = from.subspan(header);
+
+	const auto [x, y, width, height] = values;
+	if (x < 0
+		|| y < 0
+		|| width < 0
+		|| height < 0
+		|| (x % 2)
+		|| (y % 2)
+		|| (width % 2)
+		|| (height % 2)
+		|| (x + width > rows.width())
+		|| (y + height > rows.height())) {
+		return false;
+	}
+	rect = QRect(x, y, width, height);
+	const auto size = RectRowsSize(rect);
+	if (!size) {
+		return from.empty();
+	} else if (from.empty() || int(from.size()) > size) {
+		return false;
+	} else if (int(from.size()) == size) {
+		memcpy(rows.data(), from.data(), size);
+		return true;
+	}
+	const auto result = LZ4_decompress_safe(
+		reinterpret_cast<const char*>(from.data()),
+		rows.data(),
+		from.size(),
+		size);
+	return (result == size);
+}
+
+bool UncompressBands(
+		EncodedStorage &to,
+		bytes::const_span from,
+		int threads) {
+	const auto bands = BandsCount(to.height());
+	const auto lengths = bands * kBandParts;
+	auto count = qint32(0);
+	if (from.size() < sizeof(count) * (1 + lengths)) {
+		return false;
+	}
+	memcpy(&count, from.data(), sizeof(count));
+	if (count != bands) {
+		return false;
+	}
+	auto sizes = std::vector<qint32>(lengths);
+	memcpy(sizes.data(), from.data() + sizeof(count), lengths * sizeof(qint32));
+	from = from.subspan(sizeof(count) * (1 + lengths));
+
+	// Offsets of the bands in the data are known before uncompressing.
+	auto offsets = std::vector<int>(bands + 1);
+	for (auto band = 0; band != bands; ++band) {
+		auto size = 0;
+		for (auto i = 0; i != kBandParts; ++i) {
+			const auto length = sizes[band * kBandParts + i];
+			if (length < 0) {
+				return false;
+			}
+			size += length;
+		}
+		offsets[band + 1] = offsets[band] + size;
+	}
+	if (offsets.back() != int(from.size())) {
+		return false;
+	}
+	auto failed = std::atomic<bool>(false);
+	const auto uncompressBand = [&](int band) {
+		const auto parts = BandParts(to, band);
+		auto source = reinterpret_cast<const char*>(from.data())
+			+ offsets[band];
+		for (auto i = 0; i != kBandParts; ++i) {
+			const auto destination = reinterpret_cast<char*>(parts[i].data);
+			const auto size = parts[i].size;
+			const auto length = sizes[band * kBandParts + i];
+			if (length > size || (!length && size)) {
+				failed = true;
+				return;
+			} else if (length == size) {
+				memcpy(destination, source, size);
+			} else if (LZ4_decompress_safe(
+					source,
+					destination,
+					length,
+					size) != size) {
+				failed = true;
+				return;
+			}
+			source += length;
+		}
+	};
+	if (threads > 1 && bands > 1) {
+		RunWorkStealing(bands, threads, uncompressBand);
+	} else {
+		for (auto band = 0; band != bands; ++band) {
+			uncompressBand(band);
+		}
+	}
+	return !failed;
+}
+
 } // namespace Lottie
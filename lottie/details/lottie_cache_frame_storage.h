@@ -8,12 +8,21 @@
 
 #include "ffmpeg/ffmpeg_utility.h"
 
+#include <QtCore/QRect>
+#include <array>
+#include <vector>
+
 namespace Lottie {
 
 class EncodedStorage {
 public:
 	void allocate(int width, int height);
 
+	// A single 8 bit plane in place of the Y one, with alpha values
+	// or palette indices.
+	void allocatePlane(int width, int height);
+	[[nodiscard]] bool singlePlane() const;
+
 	int width() const;
 	int height() const;
 
@@ -39,31 +48,127 @@ private:
 
 	int _width = 0;
 	int _height = 0;
+	bool _singlePlane = false;
 	QByteArray _data;
 
 };
 
 void Xor(EncodedStorage &to, const EncodedStorage &from);
 
-void Encode(
+void Encode(EncodedStorage &to, const QImage &from);
+
+// With threads > 1 bands of rows are converted in parallel.
+void Decode(
+	QImage &to,
+	const EncodedStorage &from,
+	const QSize &fromSize,
+	int threads = 1);
+
+// Premultiplied colors of an animation, in the order they were met.
+class FramePalette {
+public:
+	static constexpr auto kMaxColors = 256;
+
+	FramePalette();
+
+	// Index of the color, added if it is new, -1 if there is no room.
+	[[nodiscard]] int index(uint32 color);
+	[[nodiscard]] int size() const;
+	[[nodiscard]] const std::vector<uint32> &colors() const;
+	void clear();
+
+	// Palette frames start with the colors added since the previous
+	// frame, keyframes with all of them, so that seeking works.
+	void write(QByteArray &to, int from) const;
+	[[nodiscard]] int read(bytes::const_span from);
+
+private:
+	static constexpr auto kTableBits = 10;
+
+	std::vector<uint32> _colors;
+	std::array<int16, (1 << kTableBits)> _table = { { 0 } };
+
+};
+
+// Returns false if the frame has more colors than the palette fits.
+[[nodiscard]] bool EncodePalette(
 	EncodedStorage &to,
 	const QImage &from,
-	QImage &cache,
-	FFmpeg::SwscalePointer &context);
+	FramePalette &palette);
+void DecodePalette(
+	QImage &to,
+	const EncodedStorage &from,
+	const QSize &fromSize,
+	const FramePalette &palette);
 
-void Decode(
+// Colorized frames keep only alpha, the color is applied on decode.
+void EncodeAlpha(EncodedStorage &to, const QImage &from);
+void DecodeAlpha(
 	QImage &to,
 	const EncodedStorage &from,
 	const QSize &fromSize,
-	FFmpeg::SwscalePointer &context);
+	QColor color);
 
-void CompressFromRaw(QByteArray &to, const EncodedStorage &from);
+// High compression is much slower, but decompresses as fast.
+void CompressFromRaw(
+	QByteArray &to,
+	const EncodedStorage &from,
+	bool high = false);
 void CompressAndSwapFrame(
 	QByteArray &to,
 	QByteArray *additional,
 	EncodedStorage &frame,
 	EncodedStorage &previous);
 
+// The frame is split into chunks, each compressed with the nearby part
+// of the previous frame as an LZ4 dictionary. Writes a negative length.
+void CompressWithPrevious(
+	QByteArray &to,
+	const EncodedStorage &frame,
+	const EncodedStorage &previous,
+	bool high = false);
+
+// Bounding box of the changed pixels, aligned to the 2x2 chroma blocks.
+[[nodiscard]] QRect ChangedRect(
+	const EncodedStorage &frame,
+	const EncodedStorage &previous);
+
+// Stores the changed rect and the XOR-ed rows of the frame inside it,
+// packed in 'rows'. Writes a negative length.
+void CompressRectDelta(
+	QByteArray &to,
+	EncodedStorage &rows,
+	const EncodedStorage &frame,
+	const EncodedStorage &previous);
+void CompressRectRows(
+	QByteArray &to,
+	const EncodedStorage &rows,
+	QRect rect,
+	bool high = false);
+void XorRect(EncodedStorage &to, const EncodedStorage &rows, QRect rect);
+
+// Each band of rows has its own Y, U, V and A blocks, so bands are
+// compressed and uncompressed in parallel. Writes a negative length
+// for a delta frame.
+void CompressBands(
+	QByteArray &to,
+	const EncodedStorage &from,
+	bool delta,
+	int threads,
+	bool high = false);
+
 bool UncompressToRaw(EncodedStorage &to, bytes::const_span from);
+bool UncompressBands(
+	EncodedStorage &to,
+	bytes::const_span from,
+	int threads);
+bool UncompressRectDelta(
+	EncodedStorage &rows,
+	bytes::const_span from,
+	QRect &rect);
+bool UncompressWithPrevious(
+	EncodedStorage &to,
+	bytes::const_span from,
+	const EncodedStorage &previous);
 
 } // namespace Lottie
@@ -34,6 +34,21 @@ public:
 		return nullptr;
 	}
 
+	[[nodiscard]] virtual QByteArray contentKey() {
+		// Providers with the same non-empty key render the same frames.
+		return QByteArray();
+	}
+
+	[[nodiscard]] virtual bool canSkipFrames() {
+		// Cached providers fill the cache only with consecutive frames.
+		return true;
+	}
+
+	[[nodiscard]] virtual bool canSeekBackward() {
+		// Caches without frame offsets are read only from the start.
+		return true;
+	}
+
 	virtual bool render(
 		const std::unique_ptr<FrameProviderToken> &token,
 		QImage &to,
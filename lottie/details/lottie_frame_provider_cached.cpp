@@ -15,10 +15,40 @@ FrameProviderCached::FrameProviderCached(
 	const FrameRequest &request,
 	Quality quality,
 	const ColorReplacements *replacements)
-: _cache(cached, request, std::move(put))
+: FrameProviderCached(
+	Cache(cached, request, std::move(put)),
+	content,
+	quality,
+	replacements) {
+}
+
+FrameProviderCached::FrameProviderCached(
+	const QByteArray &content,
+	FnMut<void(QByteArray &&cached)> put,
+	std::shared_ptr<const CacheMapping> cached,
+	const FrameRequest &request,
+	Quality quality,
+	const ColorReplacements *replacements)
+: FrameProviderCached(
+	Cache(std::move(cached), request, std::move(put)),
+	content,
+	quality,
+	replacements) {
+}
+
+FrameProviderCached::FrameProviderCached(
+	Cache &&cache,
+	const QByteArray &content,
+	Quality quality,
+	const ColorReplacements *replacements)
+: _cache(std::move(cache))
 , _direct(quality)
 , _content(content)
-, _replacements(replacements) {
+, _replacements(replacements)
+, _contentKey(FrameProviderDirect::ContentKey(
+	content,
+	replacements,
+	quality).append("cached")) {
 	if (!_cache.framesCount()
 		|| (_cache.framesReady() < _cache.framesCount())) {
 		if (!_direct.load(content, replacements)) {
@@ -65,6 +95,10 @@ bool FrameProviderCached::valid() {
 	return _direct.valid();
 }
 
+QByteArray FrameProviderCached::contentKey() {
+	return _contentKey;
+}
+
 int FrameProviderCached::sizeRounding() {
 	return _cache.sizeRounding();
 }
@@ -75,6 +109,14 @@ std::unique_ptr<FrameProviderToken> FrameProviderCached::createToken() {
 	return result;
 }
 
+bool FrameProviderCached::canSkipFrames() {
+	return (_cache.framesReady() == _cache.framesCount());
+}
+
+bool FrameProviderCached::canSeekBackward() {
+	return _cache.canSeekBackward();
+}
+
 bool FrameProviderCached::render(
 		const std::unique_ptr<FrameProviderToken> &token,
 		QImage &to,
@@ -25,15 +25,28 @@ public:
 		Quality quality,
 		const ColorReplacements *replacements);
 
+	// Frames are read right from the mapping, many players of the
+	// same animation can share it.
+	FrameProviderCached(
+		const QByteArray &content,
+		FnMut<void(QByteArray &&cached)> put,
+		std::shared_ptr<const CacheMapping> cached,
+		const FrameRequest &request,
+		Quality quality,
+		const ColorReplacements *replacements);
+
 	QImage construct(
 		std::unique_ptr<FrameProviderToken> &token,
 		const FrameRequest &request) override;
 	const Information &information() override;
 	bool valid() override;
+	QByteArray contentKey() override;
 
 	int sizeRounding() override;
 
 	std::unique_ptr<FrameProviderToken> createToken() override;
+	bool canSkipFrames() override;
+	bool canSeekBackward() override;
 
 	bool render(
 		const std::unique_ptr<FrameProviderToken> &token,
@@ -42,10 +55,17 @@ public:
 		int index) override;
 
 private:
+	FrameProviderCached(
+		Cache &&cache,
+		const QByteArray &content,
+		Quality quality,
+		const ColorReplacements *replacements);
+
 	Cache _cache;
 	FrameProviderDirect _direct;
 	const QByteArray _content;
 	const ColorReplacements *_replacements = nullptr;
+	const QByteArray _contentKey;
 
 };
 
@@ -6,11 +6,42 @@
 //
 #include "lottie/details/lottie_frame_provider_cached_multi.h"
 
+#include "lottie/details/lottie_frame_renderer.h"
 #include "base/assertion.h"
 
+#include <crl/crl_queue.h>
+#include <QMutex>
+#include <range/v3/algorithm/all_of.hpp>
 #include <range/v3/numeric/accumulate.hpp>
 
 namespace Lottie {
+namespace {
+
+// Segments are encoded one by one, each may take seconds, so they
+// don't hold the threads that render the frames being played.
+[[nodiscard]] crl::queue &EncodingQueue() {
+	static auto result = crl::queue();
+	return result;
+}
+
+} // namespace
+
+// Segments after the first one don't depend on each other, so on the
+// first load they are rendered and encoded in the background, each by
+// its own animation instance, while the first segment is played.
+struct FrameProviderCachedMulti::Encoding {
+	QByteArray content;
+	std::optional<ColorReplacements> replacements;
+	FrameRequest request;
+	Information information;
+	Quality quality = Quality::Default;
+	int framesPerCache = 0;
+	int cachesCount = 0;
+
+	QMutex mutex;
+	std::vector<QByteArray> results;
+	std::atomic<bool> cancelled = false;
+};
 
 FrameProviderCachedMulti::FrameProviderCachedMulti(
 	const QByteArray &content,
@@ -22,7 +53,8 @@ FrameProviderCachedMulti::FrameProviderCachedMulti(
 : _content(content)
 , _replacements(replacements)
 , _put(std::move(put))
-, _direct(quality) {
+, _direct(quality)
+, _quality(quality) {
 	Expects(!caches.empty());
 
 	_caches.reserve(caches.size());
@@ -87,6 +119,12 @@ FrameProviderCachedMulti::FrameProviderCachedMulti(
 	}
 }
 
+FrameProviderCachedMulti::~FrameProviderCachedMulti() {
+	if (_encoding) {
+		_encoding->cancelled = true;
+	}
+}
+
 bool FrameProviderCachedMulti::validateFramesPerCache() {
 	const auto &info = information();
 	const auto count = int(_caches.size());
@@ -127,9 +165,13 @@ QImage FrameProviderCachedMulti::construct(
 	if (!my || my->exclusive) {
 		const auto &info = information();
 		const auto count = int(_caches.size());
+		auto encode = std::vector<int>();
 		for (auto i = 0; i != count; ++i) {
 			auto cacheCover = _caches[i].takeFirstFrame();
 			if (cacheCover.isNull()) {
+				if (i > 0) {
+					encode.push_back(i);
+				}
 				_caches[i].init(
 					info.size,
 					info.frameRate,
@@ -141,9 +183,13 @@ QImage FrameProviderCachedMulti::construct(
 				cover = std::move(cacheCover);
 			}
 		}
+		if (!encode.empty() && !_encoding) {
+			startEncoding(std::move(encode), request);
+		}
 		if (!cover.isNull()) {
 			if (my) {
 				_caches[0].keepUpContext(my->context);
+				my->cacheIndex = 0;
 			}
 			return cover;
 		}
@@ -172,6 +218,16 @@ std::unique_ptr<FrameProviderToken> FrameProviderCachedMulti::createToken() {
 	return result;
 }
 
+bool FrameProviderCachedMulti::canSkipFrames() {
+	return ranges::all_of(_caches, [](const Cache &cache) {
+		return (cache.framesReady() == cache.framesCount());
+	});
+}
+
+bool FrameProviderCachedMulti::canSeekBackward() {
+	return ranges::all_of(_caches, &Cache::canSeekBackward);
+}
+
 bool FrameProviderCachedMulti::render(
 		const std::unique_ptr<FrameProviderToken> &token,
 		QImage &to,
@@ -193,12 +249,20 @@ bool FrameProviderCachedMulti::render(
 	}
 	const auto cacheIndex = index / _framesPerCache;
 	const auto indexInCache = index % _framesPerCache;
-	Assert(cacheIndex < _caches.size());
+	Assert(cacheIndex < int(_caches.size()));
 	auto &cache = _caches[cacheIndex];
 	using Token = FrameProviderCachedMultiToken;
 	const auto my = static_cast<Token*>(token.get());
 	if (my && !my->exclusive) {
 		// Many threads may get here simultaneously.
+		// A cache replaced by applyEncoded() has a new generation,
+		// the context is prepared for it in renderFrame() then.
+		if (my->cacheIndex != cacheIndex) {
+			// Going backwards the context may be in the middle of the
+			// next segment, start reading this one from the beginning.
+			cache.prepareBuffers(my->context);
+			my->cacheIndex = cacheIndex;
+		}
 		my->result = cache.renderFrame(
 			my->context,
 			to,
@@ -206,10 +270,19 @@ bool FrameProviderCachedMulti::render(
 			indexInCache);
 		return (my->result == FrameRenderResult::Ok);
 	}
+	if (_encoding) {
+		applyEncoded(cacheIndex, request);
+		if (canSkipFrames()) {
+			// All the segments are ready, no need to lock anymore.
+			_encoding->cancelled = true;
+			_encoding = nullptr;
+		}
+	}
 	const auto result = cache.renderFrame(to, request, indexInCache);
 	if (result == FrameRenderResult::Ok) {
 		if (my) {
 			cache.keepUpContext(my->context);
+			my->cacheIndex = cacheIndex;
 		}
 		return true;
 	} else if (result == FrameRenderResult::Failed
@@ -222,13 +295,118 @@ bool FrameProviderCachedMulti::render(
 	_direct.renderToPrepared(to, index);
 	cache.appendFrame(to, request, indexInCache);
 	if (cache.framesReady() == cache.framesCount()
-		&& cacheIndex + 1 == _caches.size()) {
+		&& cacheIndex + 1 == int(_caches.size())) {
 		_direct.unload();
 	}
 	if (my) {
 		cache.keepUpContext(my->context);
+		my->cacheIndex = cacheIndex;
 	}
 	return true;
 }
 
+void FrameProviderCachedMulti::startEncoding(
+		std::vector<int> cacheIndices,
+		const FrameRequest &request) {
+	if (!_direct.loaded()) {
+		return;
+	}
+	_encoding = std::make_shared<Encoding>();
+	_encoding->content = _content;
+	if (_replacements) {
+		_encoding->replacements = *_replacements;
+	}
+	_encoding->request = request;
+	_encoding->information = information();
+	_encoding->quality = _quality;
+	_encoding->framesPerCache = _framesPerCache;
+	_encoding->cachesCount = int(_caches.size());
+	_encoding->results.resize(_caches.size());
+
+	for (const auto cacheIndex : cacheIndices) {
+		EncodingQueue().async([=, encoding = _encoding] {
+			auto result = EncodeSegment(*encoding, cacheIndex);
+			QMutexLocker lock(&encoding->mutex);
+			encoding->results[cacheIndex] = std::move(result);
+		});
+	}
+}
+
+QByteArray FrameProviderCachedMulti::EncodeSegment(
+		const Encoding &encoding,
+		int cacheIndex) {
+	auto direct = FrameProviderDirect(encoding.quality);
+	const auto replacements = encoding.replacements
+		? &*encoding.replacements
+		: nullptr;
+	if (encoding.cancelled || !direct.load(encoding.content, replacements)) {
+		return QByteArray();
+	}
+	const auto &info = encoding.information;
+	const auto first = cacheIndex * encoding.framesPerCache;
+	const auto count = (cacheIndex + 1 == encoding.cachesCount)
+		? (info.framesCount - first)
+		: encoding.framesPerCache;
+	auto result = QByteArray();
+	auto cache = Cache(QByteArray(), encoding.request, [&](
+			QByteArray &&cached) {
+		result = std::move(cached);
+	});
+	cache.init(info.size, info.frameRate, count, encoding.request);
+
+	// The cache would be destroyed before its background recompression
+	// finishes, so it is recompressed here, in the worker.
+	cache.setBackgroundRecompression(false);
+	auto frame = CreateFrameStorage(
+		encoding.request.size(info.size, cache.sizeRounding()));
+	for (auto i = 0; i != count; ++i) {
+		if (encoding.cancelled) {
+			return QByteArray();
+		}
+		direct.renderToPrepared(frame, first + i);
+		cache.appendFrame(frame, encoding.request, i);
+		if (cache.framesReady() <= i) {
+			// The cache changed the encoder, all frames go again.
+			i = -1;
+		}
+	}
+	if (cache.framesReady() != count) {
+		return QByteArray();
+	}
+	auto recompressed = cache.recompressed(encoding.cancelled);
+	return recompressed.isEmpty() ? result : recompressed;
+}
+
+void FrameProviderCachedMulti::applyEncoded(
+		int cacheIndex,
+		const FrameRequest &request) {
+	auto &cache = _caches[cacheIndex];
+	if (cache.framesReady() == cache.framesCount()) {
+		return;
+	}
+	auto encoded = QByteArray();
+	{
+		QMutexLocker lock(&_encoding->mutex);
+		std::swap(encoded, _encoding->results[cacheIndex]);
+	}
+	if (encoded.isEmpty()) {
+		return;
+	}
+	auto ready = Cache(encoded, request, [=](QByteArray &&v) {
+		_put(cacheIndex, std::move(v));
+	});
+	if (ready.framesReady() != cache.framesCount()) {
+		return;
+	}
+
+	// The first frame will be decoded again when it is requested.
+	[[maybe_unused]] const auto cover = ready.takeFirstFrame();
+
+	cache = std::move(ready);
+	_put(cacheIndex, std::move(encoded));
+	if (canSkipFrames()) {
+		_direct.unload();
+	}
+}
+
 } // namespace Lottie
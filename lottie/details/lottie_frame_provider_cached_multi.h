@@ -13,6 +13,7 @@ namespace Lottie {
 
 struct FrameProviderCachedMultiToken : FrameProviderToken {
 	CacheReadContext context;
+	int cacheIndex = 0;
 };
 
 class FrameProviderCachedMulti final : public FrameProvider {
@@ -25,6 +26,8 @@ public:
 		Quality quality,
 		const ColorReplacements *replacements);
 
+	~FrameProviderCachedMulti();
+
 	FrameProviderCachedMulti(const FrameProviderCachedMulti &) = delete;
 	FrameProviderCachedMulti &operator=(const FrameProviderCachedMulti &)
 		= delete;
@@ -38,6 +41,8 @@ public:
 	int sizeRounding() override;
 
 	std::unique_ptr<FrameProviderToken> createToken() override;
+	bool canSkipFrames() override;
+	bool canSeekBackward() override;
 
 	bool render(
 		const std::unique_ptr<FrameProviderToken> &token,
@@ -46,13 +51,24 @@ public:
 		int index) override;
 
 private:
+	struct Encoding;
+
 	bool validateFramesPerCache();
+	void startEncoding(
+		std::vector<int> cacheIndices,
+		const FrameRequest &request);
+	void applyEncoded(int cacheIndex, const FrameRequest &request);
+	[[nodiscard]] static QByteArray EncodeSegment(
+		const Encoding &encoding,
+		int cacheIndex);
 
 	const QByteArray _content;
 	const ColorReplacements *_replacements = nullptr;
 	FnMut<void(int index, QByteArray &&cached)> _put;
 	FrameProviderDirect _direct;
 	std::vector<Cache> _caches;
+	std::shared_ptr<Encoding> _encoding;
+	Quality _quality = Quality::Default;
 	int _framesPerCache = 0;
 
 };
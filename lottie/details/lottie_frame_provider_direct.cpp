@@ -10,6 +10,7 @@
 #include "lottie/details/lottie_frame_renderer.h"
 #include "ui/image/image_prepare.h"
 
+#include <QCryptographicHash>
 #include <rlottie.h>
 
 namespace Lottie {
@@ -58,6 +59,7 @@ bool FrameProviderDirect::load(
 		const QByteArray &content,
 		const ColorReplacements *replacements) {
 	_information = Information();
+	_contentKey = QByteArray();
 
 	const auto string = ReadUtf8(Images::UnpackGzip(content));
 	if (string.size() > kMaxFileSize) {
@@ -83,6 +85,7 @@ bool FrameProviderDirect::load(
 	_animation->size(width, height);
 	const auto rate = GetLottieFrameRate(_animation.get(), _quality);
 	const auto count = GetLottieFramesCount(_animation.get(), _quality);
+	_contentKey = ContentKey(content, replacements, _quality);
 	return setInformation({
 		.size = QSize(int(width), int(height)),
 		.frameRate = int(rate),
@@ -90,6 +93,32 @@ bool FrameProviderDirect::load(
 	});
 }
 
+QByteArray FrameProviderDirect::ContentKey(
+		const QByteArray &content,
+		const ColorReplacements *replacements,
+		Quality quality) {
+	const auto add = [](QCryptographicHash &hash, const auto &value) {
+		hash.addData(QByteArray::fromRawData(
+			reinterpret_cast<const char*>(&value),
+			sizeof(value)));
+	};
+	auto hash = QCryptographicHash(QCryptographicHash::Sha1);
+	hash.addData(content);
+	if (replacements) {
+		for (const auto &[from, to] : replacements->replacements) {
+			add(hash, from);
+			add(hash, to);
+		}
+		add(hash, replacements->modifier);
+	}
+	add(hash, quality);
+	return hash.result();
+}
+
+QByteArray FrameProviderDirect::contentKey() {
+	return _contentKey;
+}
+
 bool FrameProviderDirect::loaded() const {
 	return (_animation != nullptr);
 }
@@ -28,11 +28,17 @@ public:
 
 	bool setInformation(Information information);
 
+	[[nodiscard]] static QByteArray ContentKey(
+		const QByteArray &content,
+		const ColorReplacements *replacements,
+		Quality quality);
+
 	QImage construct(
 		std::unique_ptr<FrameProviderToken> &token,
 		const FrameRequest &request) override;
 	const Information &information() override;
 	bool valid() override;
+	QByteArray contentKey() override;
 
 	int sizeRounding() override;
 
@@ -50,6 +56,7 @@ private:
 
 	std::unique_ptr<rlottie::Animation> _animation;
 	Information _information;
+	QByteArray _contentKey;
 	Quality _quality = Quality::Default;
 
 };
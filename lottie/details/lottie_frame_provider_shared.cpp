@@ -58,6 +58,16 @@ std::unique_ptr<FrameProviderToken> FrameProviderShared::createToken() {
 	return _shared->createToken();
 }
 
+bool FrameProviderShared::canSkipFrames() {
+	QReadLocker lock(&_mutex);
+	return _shared && _shared->canSkipFrames();
+}
+
+bool FrameProviderShared::canSeekBackward() {
+	QReadLocker lock(&_mutex);
+	return _shared && _shared->canSeekBackward();
+}
+
 bool FrameProviderShared::render(
 		const std::unique_ptr<FrameProviderToken> &token,
 		QImage &to,
@@ -29,6 +29,8 @@ public:
 	int sizeRounding() override;
 
 	std::unique_ptr<FrameProviderToken> createToken() override;
+	bool canSkipFrames() override;
+	bool canSeekBackward() override;
 
 	bool render(
 		const std::unique_ptr<FrameProviderToken> &token,
@@ -9,6 +9,8 @@
 #include "lottie/lottie_player.h"
 #include "lottie/lottie_animation.h"
 #include "lottie/details/lottie_frame_provider.h"
+#include "lottie/details/lottie_frame_trace.h"
+#include "lottie/details/lottie_work_stealing.h"
 #include "ui/image/image_prepare.h"
 #include "base/flat_map.h"
 #include "base/assertion.h"
@@ -16,19 +18,27 @@
 #include <QPainter>
 #include <rlottie.h>
 #include <range/v3/algorithm/find.hpp>
-#include <range/v3/algorithm/count_if.hpp>
+#include <range/v3/algorithm/find_if.hpp>
+#include <range/v3/algorithm/sort.hpp>
 
 namespace Lottie {
 namespace {
 
+constexpr auto kMinAdaptiveFrameRate = 15;
+
+// Don't give prerendering back sooner after it was taken away.
+constexpr auto kMemoryBudgetRestoreDelay = crl::time(1000);
+
 std::weak_ptr<FrameRenderer> GlobalInstance;
 
 } // namespace
 
 class FrameRendererObject final {
 public:
-	explicit FrameRendererObject(
-		crl::weak_on_queue<FrameRendererObject> weak);
+	FrameRendererObject(
+		crl::weak_on_queue<FrameRendererObject> weak,
+		int threads,
+		std::shared_ptr<std::atomic<int64>> memoryUsage);
 
 	void append(
 		std::unique_ptr<SharedState> entry,
@@ -38,11 +48,16 @@ public:
 		not_null<SharedState*> entry,
 		const FrameRequest &request);
 	void remove(not_null<SharedState*> entry);
+	void setVisible(not_null<SharedState*> entry, bool visible);
+	void setMemoryBudget(int64 bytes);
 
 private:
 	struct Entry {
 		std::unique_ptr<SharedState> state;
 		FrameRequest request;
+		int64 released = 0; // Frames memory freed when limited.
+		bool hidden = false;
+		bool limited = false;
 	};
 
 	static not_null<SharedState*> StateFromEntry(const Entry &entry) {
@@ -51,9 +66,15 @@ private:
 
 	void queueGenerateFrames();
 	void generateFrames();
+	void applyMemoryBudget();
 
 	crl::weak_on_queue<FrameRendererObject> _weak;
 	std::vector<Entry> _entries;
+	const std::shared_ptr<std::atomic<int64>> _memoryUsage;
+	int64 _memoryBudget = 0;
+	crl::time _lastLimited = 0;
+	crl::profile_time _queuedAt = 0;
+	int _threads = 1;
 	bool _queued = false;
 
 };
@@ -119,8 +140,12 @@ QImage PrepareFrameByRequest(
 }
 
 FrameRendererObject::FrameRendererObject(
-	crl::weak_on_queue<FrameRendererObject> weak)
-: _weak(std::move(weak)) {
+	crl::weak_on_queue<FrameRendererObject> weak,
+	int threads,
+	std::shared_ptr<std::atomic<int64>> memoryUsage)
+: _weak(std::move(weak))
+, _memoryUsage(std::move(memoryUsage))
+, _threads(std::clamp(threads, 1, MaxWorkerThreads())) {
 }
 
 void FrameRendererObject::append(
@@ -148,16 +173,179 @@ void FrameRendererObject::remove(not_null<SharedState*> entry) {
 	_entries.erase(i);
 }
 
+void FrameRendererObject::setVisible(
+		not_null<SharedState*> entry,
+		bool visible) {
+	const auto i = ranges::find(_entries, entry, &StateFromEntry);
+	Assert(i != end(_entries));
+	if (i->hidden != visible) {
+		return;
+	}
+	i->hidden = !visible;
+	if (i->hidden) {
+		i->state->releaseFrames();
+	} else {
+		queueGenerateFrames();
+	}
+}
+
+void FrameRendererObject::setMemoryBudget(int64 bytes) {
+	_memoryBudget = std::max(bytes, int64());
+	applyMemoryBudget();
+	queueGenerateFrames();
+}
+
+void FrameRendererObject::applyMemoryBudget() {
+	auto usage = int64();
+	for (const auto &entry : _entries) {
+		usage += entry.state->framesMemory();
+	}
+	const auto byLastPainted = [&](bool limited) {
+		auto result = std::vector<not_null<Entry*>>();
+		for (auto &entry : _entries) {
+			if (entry.limited == limited) {
+				result.push_back(&entry);
+			}
+		}
+		ranges::sort(result, ranges::less(), [](not_null<Entry*> entry) {
+			return entry->state->lastPainted();
+		});
+		return result;
+	};
+	if (_memoryBudget && usage > _memoryBudget) {
+		for (const auto entry : byLastPainted(false)) {
+			const auto state = entry->state.get();
+			const auto was = state->framesMemory();
+			state->releaseFrames();
+			state->setPrerender(false);
+			const auto now = state->framesMemory();
+			usage += now - was;
+			entry->released = was - now;
+			entry->limited = true;
+			if (usage <= _memoryBudget) {
+				break;
+			}
+		}
+		_lastLimited = crl::now();
+	} else {
+		// Give prerendering back one by one, starting from the most
+		// recently painted, and only if the frames it will take back
+		// keep us well under the budget, so we don't swing back and forth.
+		const auto limited = byLastPainted(true);
+		if (!limited.empty()) {
+			const auto entry = limited.back();
+			const auto fits = !_memoryBudget
+				|| ((crl::now() - _lastLimited >= kMemoryBudgetRestoreDelay)
+					&& ((usage + entry->released) * 4
+						<= _memoryBudget * 3));
+			if (fits) {
+				entry->state->setPrerender(true);
+				entry->limited = false;
+				entry->released = 0;
+			}
+		}
+	}
+	_memoryUsage->store(usage, std::memory_order_relaxed);
+}
+
 void FrameRendererObject::generateFrames() {
+	struct Scheduled {
+		crl::time deadline = 0;
+		int index = 0;
+	};
+	const auto count = int(_entries.size());
+	auto schedule = std::vector<Scheduled>();
+	schedule.reserve(count);
+	for (auto i = 0; i != count; ++i) {
+		if (!_entries[i].hidden) {
+			schedule.push_back({ _entries[i].state->renderDeadline(), i });
+		}
+	}
+
+	// Earliest deadline first, the frame most at risk of being late
+	// is produced before the others.
+	ranges::sort(schedule, ranges::less(), &Scheduled::deadline);
+
+	// Entries showing the same content with the same request are grouped,
+	// so each frame is rendered only once.
+	auto groups = std::vector<std::vector<int>>();
+	auto groupsByKey = base::flat_map<QByteArray, std::vector<int>>();
+	groups.reserve(schedule.size());
+
+	// Groups using one provider are joined and rendered by one worker,
+	// a bare provider, like FrameProviderDirect, isn't reentrant.
+	auto joined = std::vector<int>();
+	auto groupByProvider = base::flat_map<const FrameProvider*, int>();
+	const auto root = [&](int group) {
+		while (joined[group] != group) {
+			group = joined[group] = joined[joined[group]];
+		}
+		return group;
+	};
+	for (auto position = 0; position != int(schedule.size()); ++position) {
+		const auto &entry = _entries[schedule[position].index];
+		auto &candidates = groupsByKey[entry.state->sharingKey()];
+		const auto i = ranges::find_if(candidates, [&](int group) {
+			const auto first = schedule[groups[group].front()].index;
+			return (_entries[first].request == entry.request);
+		});
+		auto group = 0;
+		if (i != end(candidates)) {
+			group = *i;
+			groups[group].push_back(position);
+		} else {
+			group = int(groups.size());
+			candidates.push_back(group);
+			groups.push_back({ position });
+			joined.push_back(group);
+		}
+		const auto provider = entry.state->provider().get();
+		const auto [j, added] = groupByProvider.emplace(provider, group);
+		if (!added) {
+			joined[root(group)] = root(j->second);
+		}
+	}
+	auto units = std::vector<std::vector<int>>();
+	auto unitByRoot = base::flat_map<int, int>();
+	for (auto group = 0; group != int(groups.size()); ++group) {
+		const auto [i, added] = unitByRoot.emplace(
+			root(group),
+			int(units.size()));
+		if (added) {
+			units.emplace_back();
+		}
+		units[i->second].push_back(group);
+	}
+
+	// Each entry is rendered by a single worker, so the counter handoff
+	// between this queue and the main thread works as before.
+	auto results = std::vector<SharedState::RenderResult>(count);
+	const auto queued = _queuedAt;
+	RunWorkStealing(int(units.size()), _threads, [&](int unit) {
+		for (const auto group : units[unit]) {
+			auto shared = SharedState::SharedFrame();
+			for (const auto position : groups[group]) {
+				const auto index = schedule[position].index;
+				const auto &entry = _entries[index];
+				const auto started = crl::profile();
+				results[index] = entry.state->renderNextFrame(
+					entry.request,
+					&shared);
+				if (results[index].rendered) {
+					entry.state->timings().addWait(started - queued);
+				}
+			}
+		}
+	});
+
 	auto players = base::flat_map<Player*, base::weak_ptr<Player>>();
-	const auto renderOne = [&](const Entry &entry) {
-		const auto result = entry.state->renderNextFrame(entry.request);
+	auto rendered = false;
+	for (const auto &result : results) {
 		if (const auto player = result.notify.get()) {
 			players.emplace(player, result.notify);
 		}
-		return result.rendered;
-	};
-	const auto rendered = ranges::count_if(_entries, renderOne);
+		rendered = rendered || result.rendered;
+	}
 	if (rendered) {
 		if (!players.empty()) {
 			crl::on_main([players = std::move(players)] {
@@ -170,6 +358,7 @@ void FrameRendererObject::generateFrames() {
 		}
 		queueGenerateFrames();
 	}
+	applyMemoryBudget();
 }
 
 void FrameRendererObject::queueGenerateFrames() {
@@ -177,6 +366,7 @@ void FrameRendererObject::queueGenerateFrames() {
 		return;
 	}
 	_queued = true;
+	_queuedAt = crl::profile();
 	_weak.with([](FrameRendererObject &that) {
 		that._queued = false;
 		that.generateFrames();
@@ -186,10 +376,38 @@ void FrameRendererObject::queueGenerateFrames() {
 SharedState::SharedState(
 	std::shared_ptr<FrameProvider> provider,
 	const FrameRequest &request)
-: _provider(std::move(provider)) {
+: _frames(kDefaultFramesRingDepth)
+, _provider(std::move(provider)) {
 	if (_provider->valid()) {
 		init(_provider->construct(_token, request), request);
 	}
+	_sharingKey = _provider->contentKey();
+	if (_sharingKey.isEmpty()) {
+		// Entries using one provider show the same frames.
+		_sharingKey = QByteArray::number(quintptr(_provider.get()));
+	}
+}
+
+const QByteArray &SharedState::sharingKey() const {
+	return _sharingKey;
+}
+
+not_null<const FrameProvider*> SharedState::provider() const {
+	return _provider.get();
+}
+
+void SharedState::setFramesRingDepth(int depth) {
+	Expects(!initialized());
+
+	// The first frame keeps the cover.
+	_frames.resize(std::clamp(
+		depth,
+		kMinFramesRingDepth,
+		kMaxFramesRingDepth));
+}
+
+int SharedState::framesRingDepth() const {
+	return int(_frames.size());
 }
 
 int SharedState::sizeRounding() const {
@@ -202,6 +420,7 @@ void SharedState::init(QImage cover, const FrameRequest &request) {
 	_frames[0].request = request;
 	_frames[0].sizeRounding = sizeRounding();
 	_frames[0].original = std::move(cover);
+	_frames[0].bytes = _frames[0].original.sizeInBytes();
 	_framesCount = _provider->information().framesCount;
 }
 
@@ -214,6 +433,8 @@ void SharedState::start(
 	_started = started;
 	_delay = delay;
 	_skippedFrames = skippedFrames;
+	_renderDelay = delay;
+	_renderSkippedFrames = skippedFrames;
 	_counter.store(0, std::memory_order_release);
 }
 
@@ -223,67 +444,261 @@ bool IsRendered(not_null<const Frame*> frame) {
 
 void SharedState::renderNextFrame(
 		not_null<Frame*> frame,
-		const FrameRequest &request) {
+		const FrameRequest &request,
+		SharedFrame *shared) {
 	if (!_framesCount) {
 		return;
 	}
+	const auto started = crl::profile();
+	_frameIndex = countNextFrameIndex();
+	const auto index = countAnimationIndex(_frameIndex);
+	if (shared
+		&& shared->index == index
+		&& _provider->canSkipFrames()) {
+		_timings.addShared();
+		TraceInstant("shared", this, index);
+		frame->original = shared->original;
+		frame->prepared = shared->prepared;
+		frame->request = request;
+		frame->sizeRounding = sizeRounding();
+		frame->index = _frameIndex;
+		frame->animationIndex = index;
+		frame->displayed = kTimeUnknown;
+		frame->bytes = frame->original.sizeInBytes()
+			+ frame->prepared.sizeInBytes();
+		return;
+	}
+
+	// Don't copy the pixels still shared with other entries.
+	if (!frame->original.isDetached()) {
+		frame->original = QImage();
+	}
+	if (!frame->prepared.isDetached()) {
+		frame->prepared = QImage();
+	}
 	const auto rendered = _provider->render(
 		_token,
 		frame->original,
 		request,
-		(++_frameIndex) % _framesCount);
+		index);
 	if (!rendered) {
 		return;
 	}
+	const auto prepareStarted = crl::profile();
 	frame->request = request;
 	frame->sizeRounding = sizeRounding();
 	PrepareFrameByRequest(frame);
+	const auto finished = crl::profile();
+	_timings.addRendered(
+		prepareStarted - started,
+		finished - prepareStarted);
+	TraceComplete("render", this, index, started, prepareStarted);
+	TraceComplete("prepare", this, index, prepareStarted, finished);
 	frame->index = _frameIndex;
+	frame->animationIndex = index;
 	frame->displayed = kTimeUnknown;
+	frame->bytes = frame->original.sizeInBytes()
+		+ frame->prepared.sizeInBytes();
+	if (shared) {
+		// Before the frame is released to the main thread.
+		shared->original = frame->original;
+		shared->prepared = frame->prepared;
+		shared->index = index;
+	}
+	updateFrameStride(finished - started);
+}
+
+void SharedState::updateFrameStride(crl::profile_time renderCost) {
+	if (!_adaptiveFrameRate.load(std::memory_order_relaxed)) {
+		_frameStride = 1;
+		return;
+	}
+	_renderCost = _renderCost
+		? ((_renderCost * 7 + renderCost) / 8)
+		: renderCost;
+
+	const auto rate = _provider->information().frameRate;
+	if (!rate) {
+		return;
+	} else if (!_provider->canSkipFrames()) {
+		_frameStride = 1;
+		return;
+	}
+
+	// For 60 fps animations: 60 -> 30 -> 20 -> 15 and back.
+	// Go down when rendering takes more than half of a shown frame time,
+	// go up when it takes less than a quarter of a faster one.
+	const auto interval = crl::profile_time(1000000) / rate;
+	const auto maxStride = std::max(rate / kMinAdaptiveFrameRate, 1);
+	if (_frameStride < maxStride
+		&& _renderCost * 2 > interval * _frameStride) {
+		++_frameStride;
+	} else if (_frameStride > 1
+		&& _renderCost * 4 < interval * (_frameStride - 1)) {
+		--_frameStride;
+	}
 }
 
-auto SharedState::renderNextFrame(const FrameRequest &request)
+auto SharedState::renderNextFrame(
+	const FrameRequest &request,
+	SharedFrame *shared)
 -> RenderResult {
-	const auto prerender = [&](int index) -> RenderResult {
-		const auto frame = getFrame(index);
-		const auto next = getFrame((index + 1) % kFramesCount);
-		if (!IsRendered(frame)) {
-			renderNextFrame(frame, request);
-			return { IsRendered(frame) };
-		} else if (!IsRendered(next)) {
-			renderNextFrame(next, request);
-			return { IsRendered(next) };
+	const auto depth = framesRingDepth();
+	const auto prerender = [&](int counter) -> RenderResult {
+		if (!_prerender) {
+			return { false, {} };
+		}
+
+		// The main thread owns the painted and the presented frames,
+		// the rest of the ring is filled in order after them.
+		for (auto i = 2; i != depth; ++i) {
+			const auto frame = getFrame((counter / 2 + i) % depth);
+			if (!IsRendered(frame)) {
+				renderNextFrame(frame, request, shared);
+				return { IsRendered(frame), {} };
+			}
 		}
-		return { false };
+		return { false, {} };
 	};
-	const auto present = [&](int counter, int index) -> RenderResult {
-		const auto frame = getFrame(index);
+	const auto present = [&](int counter) -> RenderResult {
+		_renderDelay = _delay;
+		_renderSkippedFrames = _skippedFrames;
+
+		const auto frame = getFrame((counter / 2 + 1) % depth);
 		if (!IsRendered(frame)) {
-			renderNextFrame(frame, request);
+			renderNextFrame(frame, request, shared);
 			if (!IsRendered(frame)) {
-				return { false };
+				return { false, {} };
 			}
 		}
 		frame->display = countFrameDisplayTime(frame->index);
 
 		// Release this frame to the main thread for rendering.
-		_counter.store(
-			(counter + 1) % (2 * kFramesCount),
-			std::memory_order_release);
+		const auto next = nextCounter(counter);
+		_counter.store(next, std::memory_order_release);
+		TraceInstant("present", this, next);
 		return { true, _owner };
 	};
 
-	switch (counter()) {
-	case 0: return present(0, 1);
-	case 1: return prerender(2);
-	case 2: return present(2, 2);
-	case 3: return prerender(3);
-	case 4: return present(4, 3);
-	case 5: return prerender(0);
-	case 6: return present(6, 0);
-	case 7: return prerender(1);
+	const auto value = counter();
+	if (value < 0 || value >= 2 * depth) {
+		Unexpected("Counter value in Lottie::SharedState::renderNextFrame.");
 	}
-	Unexpected("Counter value in Lottie::SharedState::renderNextFrame.");
+	return (value % 2) ? prerender(value) : present(value);
+}
+
+int SharedState::countNextFrameIndex() const {
+	const auto next = _frameIndex + _frameStride;
+	if (!_keepWallClock.load(std::memory_order_relaxed)
+		// A cache being filled accepts only the frames in order.
+		|| !_provider->canSkipFrames()) {
+		return next;
+	}
+	const auto rate = _provider->information().frameRate;
+	if (!rate) {
+		return next;
+	}
+
+	// Jump to the frame that should be on the screen right now.
+	const auto elapsed = crl::now() - _started - _renderDelay;
+	const auto current = elapsed * rate / 1000 - _renderSkippedFrames;
+	return (current > next) ? int(current) : next;
+}
+
+int SharedState::countAnimationIndex(int index) const {
+	const auto mode = _playbackMode.load(std::memory_order_relaxed);
+	if (mode != PlaybackMode::Forward
+		&& (!_provider->canSkipFrames() || !_provider->canSeekBackward())) {
+		// A cache being filled accepts only the frames in order, it is
+		// filled by playing forward, after that the mode starts working.
+		// From caches without offsets each frame going backwards would
+		// be read from the start, so they are played only forward.
+		return index % _framesCount;
+	}
+	switch (mode) {
+	case PlaybackMode::Forward: return index % _framesCount;
+	case PlaybackMode::Reverse:
+		// 0, count - 1, count - 2, ..., 1, 0, so the cover comes first.
+		return (_framesCount - (index % _framesCount)) % _framesCount;
+	case PlaybackMode::PingPong: {
+		if (_framesCount < 2) {
+			return 0;
+		}
+		// 0, 1, ..., count - 1, count - 2, ..., 1, 0, 1, ...
+		const auto period = 2 * (_framesCount - 1);
+		const auto position = index % period;
+		return (position < _framesCount) ? position : (period - position);
+	}
+	}
+	Unexpected("Mode in SharedState::countAnimationIndex.");
+}
+
+crl::time SharedState::renderDeadline() const {
+	const auto value = counter();
+	if (value == kCounterUninitialized || !_framesCount) {
+		return kFrameDisplayTimeAlreadyDone;
+	}
+	const auto rate = _provider->information().frameRate;
+	if (!rate) {
+		return kFrameDisplayTimeAlreadyDone;
+	}
+
+	// The next rendered frame index, with the adaptive frame rate stride
+	// and the jumps to keep up with the wall clock taken into account.
+	const auto next = countNextFrameIndex();
+	if (value % 2) {
+		// The main thread may be changing _delay right now,
+		// so we use the timeline as it was at the last present().
+		const auto index = _renderSkippedFrames + next;
+		return _started + _renderDelay + crl::time(1000) * index / rate;
+	}
+	const auto frame = getFrame((value / 2 + 1) % framesRingDepth());
+	return countFrameDisplayTime(IsRendered(frame) ? frame->index : next);
+}
+
+void SharedState::releaseFrames() {
+	const auto value = counter();
+	if (value == kCounterUninitialized) {
+		return;
+	}
+	const auto paint = value / 2;
+	const auto presented = (value % 2) ? (nextCounter(value) / 2) : -1;
+	for (auto i = 0; i != framesRingDepth(); ++i) {
+		if (i == paint || i == presented) {
+			continue;
+		}
+		const auto frame = getFrame(i);
+		frame->original = QImage();
+		frame->prepared = QImage();
+		frame->displayed = kDisplayedInitial;
+		frame->bytes = 0;
+	}
+
+	// Continue right after the last kept frame, so the dropped frames
+	// are rendered again instead of being skipped. The next deadline
+	// is counted from _frameIndex, so it goes back with it.
+	_frameIndex = getFrame((presented >= 0) ? presented : paint)->index;
+}
+
+void SharedState::setPrerender(bool enabled) {
+	_prerender = enabled;
+}
+
+int64 SharedState::framesMemory() const {
+	// Pixels shared between entries are counted in each of them.
+	auto result = int64();
+	for (const auto &frame : _frames) {
+		result += frame.bytes;
+	}
+	return result;
+}
+
+crl::time SharedState::lastPainted() const {
+	return _lastPainted.load(std::memory_order_relaxed);
+}
+
+FrameTimingsRecorder &SharedState::timings() {
+	return _timings;
 }
 
 crl::time SharedState::countFrameDisplayTime(int index) const {
@@ -297,18 +712,22 @@ int SharedState::counter() const {
 	return _counter.load(std::memory_order_acquire);
 }
 
+int SharedState::nextCounter(int counter) const {
+	return (counter + 1) % (2 * framesRingDepth());
+}
+
 bool SharedState::initialized() const {
 	return (counter() != kCounterUninitialized);
 }
 
 not_null<Frame*> SharedState::getFrame(int index) {
-	Expects(index >= 0 && index < kFramesCount);
+	Expects(index >= 0 && index < framesRingDepth());
 
 	return &_frames[index];
 }
 
 not_null<const Frame*> SharedState::getFrame(int index) const {
-	Expects(index >= 0 && index < kFramesCount);
+	Expects(index >= 0 && index < framesRingDepth());
 
 	return &_frames[index];
 }
@@ -322,6 +741,8 @@ not_null<Frame*> SharedState::frameForPaint() {
 	Assert(!result->original.isNull());
 	Assert(result->displayed != kTimeUnknown);
 
+	_lastPainted.store(crl::now(), std::memory_order_relaxed);
+
 	return result;
 }
 
@@ -330,31 +751,22 @@ int SharedState::framesCount() const {
 }
 
 crl::time SharedState::nextFrameDisplayTime() const {
-	const auto frameDisplayTime = [&](int counter) {
-		const auto next = (counter + 1) % (2 * kFramesCount);
-		const auto index = next / 2;
-		const auto frame = getFrame(index);
-		if (frame->displayed != kTimeUnknown) {
-			// Frame already displayed, but not yet shown.
-			return kFrameDisplayTimeAlreadyDone;
-		}
-		Assert(IsRendered(frame));
-		Assert(frame->display != kTimeUnknown);
-
-		return frame->display;
-	};
-
-	switch (counter()) {
-	case 0: return kTimeUnknown;
-	case 1: return frameDisplayTime(1);
-	case 2: return kTimeUnknown;
-	case 3: return frameDisplayTime(3);
-	case 4: return kTimeUnknown;
-	case 5: return frameDisplayTime(5);
-	case 6: return kTimeUnknown;
-	case 7: return frameDisplayTime(7);
+	const auto value = counter();
+	if (value < 0 || value >= 2 * framesRingDepth()) {
+		Unexpected("Counter value in SharedState::nextFrameDisplayTime.");
+	}
+	if (!(value % 2)) {
+		return kTimeUnknown;
+	}
+	const auto frame = getFrame(nextCounter(value) / 2);
+	if (frame->displayed != kTimeUnknown) {
+		// Frame already displayed, but not yet shown.
+		return kFrameDisplayTimeAlreadyDone;
 	}
-	Unexpected("Counter value in VideoTrack::Shared::nextFrameDisplayTime.");
+	Assert(IsRendered(frame));
+	Assert(frame->display != kTimeUnknown);
+
+	return frame->display;
 }
 
 void SharedState::addTimelineDelay(crl::time delayed, int skippedFrames) {
@@ -362,89 +774,83 @@ void SharedState::addTimelineDelay(crl::time delayed, int skippedFrames) {
 		return;
 	}
 
-	const auto recountCurrentFrame = [&](int counter) {
-		_delay += delayed;
-		_skippedFrames += skippedFrames;
-
-		const auto next = (counter + 1) % (2 * kFramesCount);
-		const auto index = next / 2;
-		const auto frame = getFrame(index);
-		if (frame->displayed != kTimeUnknown) {
-			// Frame already displayed.
-			return;
-		}
-		Assert(IsRendered(frame));
-		Assert(frame->display != kTimeUnknown);
-		frame->display = countFrameDisplayTime(frame->index);
-	};
+	const auto value = counter();
+	if (value < 0 || value >= 2 * framesRingDepth()) {
+		Unexpected("Counter value in SharedState::addTimelineDelay.");
+	}
+	if (!(value % 2)) {
+		Unexpected("Even value in SharedState::addTimelineDelay.");
+	}
+	_delay += delayed;
+	_skippedFrames += skippedFrames;
 
-	switch (counter()) {
-	case 0: Unexpected("Value 0 in SharedState::addTimelineDelay.");
-	case 1: return recountCurrentFrame(1);
-	case 2: Unexpected("Value 2 in SharedState::addTimelineDelay.");
-	case 3: return recountCurrentFrame(3);
-	case 4: Unexpected("Value 4 in SharedState::addTimelineDelay.");
-	case 5: return recountCurrentFrame(5);
-	case 6: Unexpected("Value 6 in SharedState::addTimelineDelay.");
-	case 7: return recountCurrentFrame(7);
+	const auto frame = getFrame(nextCounter(value) / 2);
+	if (frame->displayed != kTimeUnknown) {
+		// Frame already displayed.
+		return;
 	}
-	Unexpected("Counter value in VideoTrack::Shared::nextFrameDisplayTime.");
+	Assert(IsRendered(frame));
+	Assert(frame->display != kTimeUnknown);
+	frame->display = countFrameDisplayTime(frame->index);
 }
 
-void SharedState::markFrameDisplayed(crl::time now) {
-	const auto mark = [&](int counter) {
-		const auto next = (counter + 1) % (2 * kFramesCount);
-		const auto index = next / 2;
-		const auto frame = getFrame(index);
-		if (frame->displayed == kTimeUnknown) {
-			frame->displayed = now;
-		}
-	};
+void SharedState::setKeepWallClock(bool keep) {
+	_keepWallClock.store(keep, std::memory_order_relaxed);
+}
+
+void SharedState::setAdaptiveFrameRate(bool adaptive) {
+	_adaptiveFrameRate.store(adaptive, std::memory_order_relaxed);
+}
+
+void SharedState::setPlaybackMode(PlaybackMode mode) {
+	_playbackMode.store(mode, std::memory_order_relaxed);
+}
 
-	switch (counter()) {
-	case 0: Unexpected("Value 0 in SharedState::markFrameDisplayed.");
-	case 1: return mark(1);
-	case 2: Unexpected("Value 2 in SharedState::markFrameDisplayed.");
-	case 3: return mark(3);
-	case 4: Unexpected("Value 4 in SharedState::markFrameDisplayed.");
-	case 5: return mark(5);
-	case 6: Unexpected("Value 6 in SharedState::markFrameDisplayed.");
-	case 7: return mark(7);
+void SharedState::markFrameDisplayed(crl::time now) {
+	const auto value = counter();
+	if (value < 0 || value >= 2 * framesRingDepth()) {
+		Unexpected("Counter value in SharedState::markFrameDisplayed.");
+	}
+	if (!(value % 2)) {
+		Unexpected("Even value in SharedState::markFrameDisplayed.");
+	}
+	const auto frame = getFrame(nextCounter(value) / 2);
+	if (frame->displayed == kTimeUnknown) {
+		frame->displayed = now;
+		_timings.addDisplayed(now - frame->display);
+		TraceInstant("displayed", this, value);
 	}
-	Unexpected("Counter value in Lottie::SharedState::markFrameDisplayed.");
 }
 
 bool SharedState::markFrameShown() {
-	const auto jump = [&](int counter) {
-		const auto next = (counter + 1) % (2 * kFramesCount);
-		const auto index = next / 2;
-		const auto frame = getFrame(index);
-		if (frame->displayed == kTimeUnknown) {
-			return false;
-		}
-		_counter.store(
-			next,
-			std::memory_order_release);
-		return true;
-	};
-
-	switch (counter()) {
-	case 0: return false;
-	case 1: return jump(1);
-	case 2: return false;
-	case 3: return jump(3);
-	case 4: return false;
-	case 5: return jump(5);
-	case 6: return false;
-	case 7: return jump(7);
+	const auto value = counter();
+	if (value < 0 || value >= 2 * framesRingDepth()) {
+		Unexpected("Counter value in SharedState::markFrameShown.");
+	}
+	if (!(value % 2)) {
+		return false;
+	}
+	const auto next = nextCounter(value);
+	const auto frame = getFrame(next / 2);
+	if (frame->displayed == kTimeUnknown) {
+		return false;
 	}
-	Unexpected("Counter value in Lottie::SharedState::markFrameShown.");
+	_counter.store(next, std::memory_order_release);
+	TraceInstant("shown", this, next);
+	return true;
 }
 
 SharedState::~SharedState() = default;
 
-std::shared_ptr<FrameRenderer> FrameRenderer::CreateIndependent() {
-	return std::make_shared<FrameRenderer>();
+FrameRenderer::FrameRenderer(int threads)
+: _memoryUsage(std::make_shared<std::atomic<int64>>(0))
+, _timings(std::make_shared<FrameTimingsRecorder>())
+, _wrapped(threads, _memoryUsage) {
+}
+
+std::shared_ptr<FrameRenderer> FrameRenderer::CreateIndependent(
+		int threads) {
+	return std::make_shared<FrameRenderer>(threads);
 }
 
 std::shared_ptr<FrameRenderer> FrameRenderer::Instance() {
@@ -459,6 +865,7 @@ std::shared_ptr<FrameRenderer> FrameRenderer::Instance() {
 void FrameRenderer::append(
 		std::unique_ptr<SharedState> entry,
 		const FrameRequest &request) {
+	entry->timings().setParent(_timings);
 	_wrapped.with([=, entry = std::move(entry)](
 			FrameRendererObject &unwrapped) mutable {
 		unwrapped.append(std::move(entry), request);
@@ -485,4 +892,24 @@ void FrameRenderer::remove(not_null<SharedState*> entry) {
 	});
 }
 
+void FrameRenderer::setVisible(not_null<SharedState*> entry, bool visible) {
+	_wrapped.with([=](FrameRendererObject &unwrapped) {
+		unwrapped.setVisible(entry, visible);
+	});
+}
+
+void FrameRenderer::setMemoryBudget(int64 bytes) {
+	_wrapped.with([=](FrameRendererObject &unwrapped) {
+		unwrapped.setMemoryBudget(bytes);
+	});
+}
+
+int64 FrameRenderer::memoryUsage() const {
+	return _memoryUsage->load(std::memory_order_relaxed);
+}
+
+FrameTimings FrameRenderer::timings() const {
+	return _timings->snapshot();
+}
+
 } // namespace Lottie
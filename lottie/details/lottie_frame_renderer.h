@@ -9,6 +9,7 @@
 #include "base/basic_types.h"
 #include "base/weak_ptr.h"
 #include "lottie/lottie_common.h"
+#include "lottie/details/lottie_frame_timings.h"
 
 #include <QImage>
 #include <QSize>
@@ -26,6 +27,9 @@ inline constexpr auto kMaxFramesCount = 210;
 inline constexpr auto kFrameDisplayTimeAlreadyDone
 	= std::numeric_limits<crl::time>::max();
 inline constexpr auto kDisplayedInitial = crl::time(-1);
+inline constexpr auto kMinFramesRingDepth = 2;
+inline constexpr auto kDefaultFramesRingDepth = 4;
+inline constexpr auto kMaxFramesRingDepth = 16;
 
 class Player;
 class FrameProvider;
@@ -36,10 +40,14 @@ struct Frame {
 	crl::time displayed = kDisplayedInitial;
 	crl::time display = kTimeUnknown;
 	int index = 0;
+	int animationIndex = 0; // index mapped by the playback mode.
 	int sizeRounding = 0;
 
 	FrameRequest request;
 	QImage prepared;
+
+	// Written by crl::queue together with the images.
+	int64 bytes = 0;
 };
 
 QImage PrepareFrameByRequest(
@@ -61,6 +69,11 @@ public:
 	[[nodiscard]] Information information() const;
 	[[nodiscard]] bool initialized() const;
 
+	// Two frames use the least memory, but nothing is prerendered then.
+	// More frames absorb render spikes. Only before start().
+	void setFramesRingDepth(int depth);
+	[[nodiscard]] int framesRingDepth() const;
+
 	[[nodiscard]] not_null<Frame*> frameForPaint();
 	[[nodiscard]] int framesCount() const;
 	[[nodiscard]] crl::time nextFrameDisplayTime() const;
@@ -68,11 +81,50 @@ public:
 	void markFrameDisplayed(crl::time now);
 	bool markFrameShown();
 
+	// In this mode late frames are skipped instead of delaying the
+	// timeline, so the caller shouldn't call addTimelineDelay().
+	void setKeepWallClock(bool keep);
+
+	// Lower the frame rate of animations that are expensive to render.
+	void setAdaptiveFrameRate(bool adaptive);
+
+	// Applies to the frames rendered after the change.
+	void setPlaybackMode(PlaybackMode mode);
+
+	// Entries with the same key and request show the same frames.
+	[[nodiscard]] const QByteArray &sharingKey() const;
+
+	// Entries with the same provider are never rendered simultaneously.
+	[[nodiscard]] not_null<const FrameProvider*> provider() const;
+
+	// The last frame rendered for a group of entries with the same key
+	// and request, the others take it instead of rendering it again.
+	struct SharedFrame {
+		QImage original;
+		QImage prepared;
+		int index = -1;
+	};
+
 	struct RenderResult {
 		bool rendered = false;
 		base::weak_ptr<Player> notify;
 	};
-	[[nodiscard]] RenderResult renderNextFrame(const FrameRequest &request);
+	[[nodiscard]] RenderResult renderNextFrame(
+		const FrameRequest &request,
+		SharedFrame *shared = nullptr);
+
+	// Display time of the frame the next renderNextFrame() will work on.
+	[[nodiscard]] crl::time renderDeadline() const;
+
+	// Frees all the frames that are not owned by the main thread.
+	void releaseFrames();
+
+	// Without prerendering each frame is rendered when it is presented.
+	void setPrerender(bool enabled);
+	[[nodiscard]] int64 framesMemory() const;
+	[[nodiscard]] crl::time lastPainted() const;
+
+	[[nodiscard]] FrameTimingsRecorder &timings();
 
 	~SharedState();
 
@@ -80,20 +132,25 @@ private:
 	void init(QImage cover, const FrameRequest &request);
 	void renderNextFrame(
 		not_null<Frame*> frame,
-		const FrameRequest &request);
+		const FrameRequest &request,
+		SharedFrame *shared);
 	[[nodiscard]] int sizeRounding() const;
+	[[nodiscard]] int countNextFrameIndex() const;
+	[[nodiscard]] int countAnimationIndex(int index) const;
+	void updateFrameStride(crl::profile_time renderCost);
 	[[nodiscard]] crl::time countFrameDisplayTime(int index) const;
 	[[nodiscard]] not_null<Frame*> getFrame(int index);
 	[[nodiscard]] not_null<const Frame*> getFrame(int index) const;
 	[[nodiscard]] int counter() const;
+	[[nodiscard]] int nextCounter(int counter) const;
 
-	// crl::queue changes 0,2,4,6 to 1,3,5,7.
-	// main thread changes 1,3,5,7 to 2,4,6,0.
+	// For ring depth N the counter goes through 0, 1, ..., 2 * N - 1.
+	// crl::queue changes even values to odd, presenting a frame.
+	// main thread changes odd values to even, showing that frame.
 	static constexpr auto kCounterUninitialized = -1;
 	std::atomic<int> _counter = kCounterUninitialized;
 
-	static constexpr auto kFramesCount = 4;
-	std::array<Frame, kFramesCount> _frames;
+	std::vector<Frame> _frames;
 
 	base::weak_ptr<Player> _owner;
 	crl::time _started = kTimeUnknown;
@@ -102,11 +159,26 @@ private:
 	// (_counter % 2) == 0 crl::queue can read _delay.
 	crl::time _delay = kTimeUnknown;
 
+	// crl::queue copies of the timeline for prerendering deadlines.
+	crl::time _renderDelay = 0;
+	int _renderSkippedFrames = 0;
+
 	int _frameIndex = 0;
 	int _framesCount = 0;
 	int _skippedFrames = 0;
+	std::atomic<crl::time> _lastPainted = 0;
+	std::atomic<bool> _keepWallClock = false;
+	std::atomic<bool> _adaptiveFrameRate = false;
+	std::atomic<PlaybackMode> _playbackMode = PlaybackMode::Forward;
+
+	// crl::queue renders each _frameStride-th frame.
+	crl::profile_time _renderCost = 0;
+	int _frameStride = 1;
+	bool _prerender = true;
 	const std::shared_ptr<FrameProvider> _provider;
 	std::unique_ptr<FrameProviderToken> _token;
+	QByteArray _sharingKey;
+	FrameTimingsRecorder _timings;
 
 };
 
@@ -114,7 +186,11 @@ class FrameRendererObject;
 
 class FrameRenderer final {
 public:
-	static std::shared_ptr<FrameRenderer> CreateIndependent();
+	// With threads > 1 the entries are rendered by a pool of workers.
+	explicit FrameRenderer(int threads = 1);
+
+	static std::shared_ptr<FrameRenderer> CreateIndependent(
+		int threads = 1);
 	static std::shared_ptr<FrameRenderer> Instance();
 
 	void append(
@@ -127,8 +203,22 @@ public:
 	void frameShown();
 	void remove(not_null<SharedState*> state);
 
+	// Hidden entries are not rendered and keep only the frames
+	// owned by the main thread.
+	void setVisible(not_null<SharedState*> entry, bool visible);
+
+	// When frames take more than 'bytes' (zero for no limit) the least
+	// recently painted entries stop prerendering and free their frames.
+	void setMemoryBudget(int64 bytes);
+	[[nodiscard]] int64 memoryUsage() const;
+
+	// Sum of the timings of all the entries ever appended.
+	[[nodiscard]] FrameTimings timings() const;
+
 private:
 	using Implementation = FrameRendererObject;
+	const std::shared_ptr<std::atomic<int64>> _memoryUsage;
+	const std::shared_ptr<FrameTimingsRecorder> _timings;
 	crl::object_on_queue<Implementation> _wrapped;
 
 };
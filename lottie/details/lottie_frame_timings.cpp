@@ -0,0 +1,94 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "lottie/details/lottie_frame_timings.h"
+
+#include <bit>
+
+namespace Lottie {
+
+void TimingHistogramRecorder::add(crl::profile_time value) {
+	value = std::max(value, crl::profile_time(0));
+	const auto bucket = std::min(
+		int(std::bit_width(uint64(value))),
+		TimingHistogram::kBuckets - 1);
+	_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_total.fetch_add(value, std::memory_order_relaxed);
+
+	auto max = _max.load(std::memory_order_relaxed);
+	while (max < value
+		&& !_max.compare_exchange_weak(
+			max,
+			value,
+			std::memory_order_relaxed)) {
+	}
+}
+
+TimingHistogram TimingHistogramRecorder::snapshot() const {
+	auto result = TimingHistogram();
+	for (auto i = 0; i != TimingHistogram::kBuckets; ++i) {
+		result.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+	}
+	result.count = _count.load(std::memory_order_relaxed);
+	result.total = _total.load(std::memory_order_relaxed);
+	result.max = _max.load(std::memory_order_relaxed);
+	return result;
+}
+
+void FrameTimingsRecorder::setParent(
+		std::shared_ptr<FrameTimingsRecorder> parent) {
+	_parent = std::move(parent);
+}
+
+void FrameTimingsRecorder::addRendered(
+		crl::profile_time render,
+		crl::profile_time prepare) {
+	_render.add(render);
+	_prepare.add(prepare);
+	_rendered.fetch_add(1, std::memory_order_relaxed);
+	if (_parent) {
+		_parent->addRendered(render, prepare);
+	}
+}
+
+void FrameTimingsRecorder::addShared() {
+	_shared.fetch_add(1, std::memory_order_relaxed);
+	if (_parent) {
+		_parent->addShared();
+	}
+}
+
+void FrameTimingsRecorder::addWait(crl::profile_time wait) {
+	_wait.add(wait);
+	if (_parent) {
+		_parent->addWait(wait);
+	}
+}
+
+void FrameTimingsRecorder::addDisplayed(crl::time lateness) {
+	_lateness.add(lateness * 1000);
+	if (lateness > 0) {
+		_late.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (_parent) {
+		_parent->addDisplayed(lateness);
+	}
+}
+
+FrameTimings FrameTimingsRecorder::snapshot() const {
+	return {
+		.render = _render.snapshot(),
+		.prepare = _prepare.snapshot(),
+		.wait = _wait.snapshot(),
+		.lateness = _lateness.snapshot(),
+		.rendered = _rendered.load(std::memory_order_relaxed),
+		.shared = _shared.load(std::memory_order_relaxed),
+		.late = _late.load(std::memory_order_relaxed),
+	};
+}
+
+} // namespace Lottie
@@ -0,0 +1,57 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "lottie/lottie_common.h"
+
+#include <crl/crl_time.h>
+#include <atomic>
+#include <memory>
+
+namespace Lottie {
+
+class TimingHistogramRecorder final {
+public:
+	void add(crl::profile_time value);
+
+	[[nodiscard]] TimingHistogram snapshot() const;
+
+private:
+	std::array<std::atomic<int64>, TimingHistogram::kBuckets> _buckets = {};
+	std::atomic<int64> _count = 0;
+	std::atomic<int64> _total = 0;
+	std::atomic<int64> _max = 0;
+
+};
+
+// Can be written from any thread, each value is added to the parent too.
+class FrameTimingsRecorder final {
+public:
+	// Only before the recorder is used from other threads.
+	void setParent(std::shared_ptr<FrameTimingsRecorder> parent);
+
+	void addRendered(crl::profile_time render, crl::profile_time prepare);
+	void addShared();
+	void addWait(crl::profile_time wait);
+	void addDisplayed(crl::time lateness);
+
+	[[nodiscard]] FrameTimings snapshot() const;
+
+private:
+	TimingHistogramRecorder _render;
+	TimingHistogramRecorder _prepare;
+	TimingHistogramRecorder _wait;
+	TimingHistogramRecorder _lateness;
+	std::atomic<int64> _rendered = 0;
+	std::atomic<int64> _shared = 0;
+	std::atomic<int64> _late = 0;
+
+	std::shared_ptr<FrameTimingsRecorder> _parent;
+
+};
+
+} // namespace Lottie
@@ -0,0 +1,159 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "lottie/details/lottie_frame_trace.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <cstdio>
+
+namespace Lottie {
+namespace details {
+
+std::atomic<bool> TraceEnabledValue = false;
+
+} // namespace details
+namespace {
+
+constexpr auto kFlushSize = 64 * 1024;
+
+struct TraceState {
+	QMutex mutex;
+	std::unique_ptr<QFile> file;
+	QByteArray buffer;
+	bool first = true;
+};
+
+[[nodiscard]] TraceState &State() {
+	static auto result = TraceState();
+	return result;
+}
+
+[[nodiscard]] int CurrentThreadId() {
+	static auto counter = std::atomic<int>(0);
+	thread_local const auto result = ++counter;
+	return result;
+}
+
+void Flush(TraceState &state) {
+	if (state.file && !state.buffer.isEmpty()) {
+		state.file->write(state.buffer);
+	}
+	state.buffer.clear();
+}
+
+void Append(
+		const char *name,
+		char phase,
+		const void *entry,
+		int value,
+		crl::profile_time started,
+		crl::profile_time duration) {
+	char event[256];
+	const auto length = (phase == 'X')
+		? snprintf(
+			event,
+			sizeof(event),
+			"{\"name\":\"%s\",\"cat\":\"lottie\",\"ph\":\"X\","
+			"\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"entry\":\"%p\",\"value\":%d}}",
+			name,
+			(long long)started,
+			(long long)duration,
+			CurrentThreadId(),
+			entry,
+			value)
+		: snprintf(
+			event,
+			sizeof(event),
+			"{\"name\":\"%s\",\"cat\":\"lottie\",\"ph\":\"i\",\"s\":\"t\","
+			"\"ts\":%lld,\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"entry\":\"%p\",\"value\":%d}}",
+			name,
+			(long long)started,
+			CurrentThreadId(),
+			entry,
+			value);
+	if (length <= 0 || length >= int(sizeof(event))) {
+		return;
+	}
+
+	auto &state = State();
+	QMutexLocker lock(&state.mutex);
+	if (!state.file) {
+		return;
+	}
+	state.buffer.append(state.first ? "\n" : ",\n");
+	state.buffer.append(event, length);
+	state.first = false;
+	if (state.buffer.size() >= kFlushSize) {
+		Flush(state);
+	}
+}
+
+} // namespace
+
+bool StartTrace(const QString &path) {
+	StopTrace();
+
+	auto file = std::make_unique<QFile>(path);
+	if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		return false;
+	}
+	auto &state = State();
+	QMutexLocker lock(&state.mutex);
+	state.file = std::move(file);
+	state.buffer = QByteArray("[");
+	state.first = true;
+	details::TraceEnabledValue.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+void StopTrace() {
+	details::TraceEnabledValue.store(false, std::memory_order_relaxed);
+
+	auto &state = State();
+	QMutexLocker lock(&state.mutex);
+	if (!state.file) {
+		return;
+	}
+	state.buffer.append("\n]\n");
+	Flush(state);
+	state.file = nullptr;
+}
+
+void TraceInstant(const char *name, const void *entry, int value) {
+	if (TraceEnabled()) {
+		Append(name, 'i', entry, value, crl::profile(), 0);
+	}
+}
+
+void TraceComplete(
+		const char *name,
+		const void *entry,
+		int value,
+		crl::profile_time started,
+		crl::profile_time finished) {
+	if (TraceEnabled()) {
+		Append(name, 'X', entry, value, started, finished - started);
+	}
+}
+
+TraceScope::TraceScope(const char *name, const void *entry, int value)
+: _name(name)
+, _entry(entry)
+, _value(value)
+, _started(TraceEnabled() ? crl::profile() : 0) {
+}
+
+TraceScope::~TraceScope() {
+	if (_started) {
+		TraceComplete(_name, _entry, _value, _started, crl::profile());
+	}
+}
+
+} // namespace Lottie
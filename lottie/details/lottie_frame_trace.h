@@ -0,0 +1,56 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "base/basic_types.h"
+
+#include <crl/crl_time.h>
+#include <atomic>
+
+class QString;
+
+namespace Lottie {
+namespace details {
+
+extern std::atomic<bool> TraceEnabledValue;
+
+} // namespace details
+
+// Writes the frame lifecycle events in the Chrome Trace Event format,
+// the file can be opened in chrome://tracing or Perfetto.
+bool StartTrace(const QString &path);
+void StopTrace();
+
+[[nodiscard]] inline bool TraceEnabled() {
+	return details::TraceEnabledValue.load(std::memory_order_relaxed);
+}
+
+// Events of one entry (SharedState or Cache) share the 'entry' argument.
+void TraceInstant(const char *name, const void *entry, int value);
+void TraceComplete(
+	const char *name,
+	const void *entry,
+	int value,
+	crl::profile_time started,
+	crl::profile_time finished);
+
+class TraceScope final {
+public:
+	TraceScope(const char *name, const void *entry, int value);
+	TraceScope(const TraceScope &other) = delete;
+	TraceScope &operator=(const TraceScope &other) = delete;
+	~TraceScope();
+
+private:
+	const char *_name = nullptr;
+	const void *_entry = nullptr;
+	int _value = 0;
+	crl::profile_time _started = 0;
+
+};
+
+} // namespace Lottie
@@ -0,0 +1,124 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "lottie/details/lottie_work_stealing.h"
+
+#include <crl/crl_async.h>
+#include <crl/crl_semaphore.h>
+#include <thread>
+
+namespace Lottie {
+namespace {
+
+// Positions of the indices left in a deque, [front, back). The front
+// is in the high half and the back in the low half, so both ends are
+// updated by one compare-exchange.
+struct Deque {
+	std::atomic<uint64> range = 0;
+};
+
+[[nodiscard]] uint64 PackRange(uint32 front, uint32 back) {
+	return (uint64(front) << 32) | uint64(back);
+}
+
+// The owner takes from the front, keeping the order of its indices,
+// the other threads steal from the back. Returns -1 if it is empty.
+[[nodiscard]] int Take(Deque &deque, bool owner) {
+	auto range = deque.range.load(std::memory_order_relaxed);
+	while (true) {
+		const auto front = uint32(range >> 32);
+		const auto back = uint32(range & 0xFFFFFFFFULL);
+		if (front >= back) {
+			return -1;
+		}
+		const auto updated = owner
+			? PackRange(front + 1, back)
+			: PackRange(front, back - 1);
+		if (deque.range.compare_exchange_weak(
+				range,
+				updated,
+				std::memory_order_relaxed)) {
+			return int(owner ? front : (back - 1));
+		}
+	}
+}
+
+struct Pass {
+	Pass(int count, int threads, Fn<void(int index)> task)
+	: deques(std::make_unique<Deque[]>(threads))
+	, task(std::move(task))
+	, count(count)
+	, threads(threads) {
+		for (auto i = 0; i != threads; ++i) {
+			const auto size = (count - i + threads - 1) / threads;
+			deques[i].range.store(
+				PackRange(0, uint32(size)),
+				std::memory_order_relaxed);
+		}
+	}
+
+	const std::unique_ptr<Deque[]> deques;
+	const Fn<void(int index)> task;
+	const int count = 0;
+	const int threads = 0;
+	std::atomic<int> finished = 0;
+	crl::semaphore done;
+};
+
+bool RunOne(Pass &pass, int worker) {
+	for (auto i = 0; i != pass.threads; ++i) {
+		const auto owner = (worker + i) % pass.threads;
+		const auto position = Take(pass.deques[owner], (owner == worker));
+		if (position < 0) {
+			continue;
+		}
+		pass.task(owner + position * pass.threads);
+		const auto finished = pass.finished.fetch_add(
+			1,
+			std::memory_order_acq_rel) + 1;
+		if (finished == pass.count) {
+			pass.done.release();
+		}
+		return true;
+	}
+	return false;
+}
+
+void Work(Pass &pass, int worker) {
+	while (RunOne(pass, worker)) {
+	}
+}
+
+} // namespace
+
+int MaxWorkerThreads() {
+	return std::max(int(std::thread::hardware_concurrency()), 1);
+}
+
+void RunWorkStealing(int count, int threads, Fn<void(int index)> task) {
+	threads = std::clamp(std::min(threads, count), 1, MaxWorkerThreads());
+	if (threads == 1) {
+		for (auto i = 0; i != count; ++i) {
+			task(i);
+		}
+		return;
+	}
+
+	// Helpers may start after all the work is done, they hold the pass
+	// and never touch the tasks, because there is nothing left to take.
+	const auto pass = std::make_shared<Pass>(count, threads, std::move(task));
+	for (auto i = 1; i != threads; ++i) {
+		crl::async([=] {
+			Work(*pass, i);
+		});
+	}
+	Work(*pass, 0);
+	if (pass->finished.load(std::memory_order_acquire) != count) {
+		pass->done.acquire();
+	}
+}
+
+} // namespace Lottie
@@ -0,0 +1,23 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "base/basic_types.h"
+
+namespace Lottie {
+
+[[nodiscard]] int MaxWorkerThreads();
+
+// Calls task(index) for each index in [0, count) using up to 'threads'
+// threads, the calling thread is always one of them.
+//
+// Indices are dealt round-robin to per-thread deques, so each deque keeps
+// the order of the indices. A thread that drained its own deque steals
+// from the others. Returns when all the tasks are finished.
+void RunWorkStealing(int count, int threads, Fn<void(int index)> task);
+
+} // namespace Lottie
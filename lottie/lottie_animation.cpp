@@ -85,6 +85,32 @@ details::InitData Init(
 		: Error::ParseFailed;
 }
 
+details::InitData Init(
+		const QByteArray &content,
+		FnMut<void(QByteArray &&cached)> put,
+		std::shared_ptr<const CacheMapping> cached,
+		const FrameRequest &request,
+		Quality quality,
+		const ColorReplacements *replacements) {
+	Expects(!request.empty());
+
+	if (const auto error = ContentError(content)) {
+		return *error;
+	}
+	auto provider = std::make_shared<FrameProviderCached>(
+		content,
+		std::move(put),
+		std::move(cached),
+		request,
+		quality,
+		replacements);
+	return provider->valid()
+		? CheckSharedState(std::make_unique<SharedState>(
+			std::move(provider),
+			request.empty() ? FrameRequest{ kIdealSize } : request))
+		: Error::ParseFailed;
+}
+
 details::InitData Init(
 		const QByteArray &content,
 		FnMut<void(int, QByteArray &&cached)> put,
@@ -126,8 +152,8 @@ details::InitData Init(
 
 } // namespace
 
-std::shared_ptr<FrameRenderer> MakeFrameRenderer() {
-	return FrameRenderer::CreateIndependent();
+std::shared_ptr<FrameRenderer> MakeFrameRenderer(int threads) {
+	return FrameRenderer::CreateIndependent(threads);
 }
 
 QImage ReadThumbnail(const QByteArray &content) {
@@ -189,6 +215,39 @@ Animation::Animation(
 #endif // LOTTIE_USE_CACHE
 }
 
+Animation::Animation(
+	not_null<Player*> player,
+	MappedCacheTag,
+	FnMut<void(FnMut<void(
+		std::shared_ptr<const CacheMapping> cached)>)> get, // Main thread.
+	FnMut<void(QByteArray &&cached)> put, // Unknown thread.
+	const QByteArray &content,
+	const FrameRequest &request,
+	Quality quality,
+	const ColorReplacements *replacements)
+#ifdef LOTTIE_USE_CACHE
+: _player(player) {
+	const auto weak = base::make_weak(this);
+	get([=, put = std::move(put)](
+			std::shared_ptr<const CacheMapping> cached) mutable {
+		crl::async([=, put = std::move(put)]() mutable {
+			auto result = Init(
+				content,
+				std::move(put),
+				std::move(cached),
+				request,
+				quality,
+				replacements);
+			crl::on_main(weak, [=, data = std::move(result)]() mutable {
+				initDone(std::move(data));
+			});
+		});
+	});
+#else // LOTTIE_USE_CACHE
+: Animation(player, content, request, quality, replacements) {
+#endif // LOTTIE_USE_CACHE
+}
+
 Animation::Animation(
 	not_null<Player*> player,
 	int keysCount,
@@ -301,15 +360,14 @@ auto Animation::frameInfo(const FrameRequest &request) const -> FrameInfo {
 	}
 	return {
 		PrepareFrameByRequest(frame, !changed),
-		frame->index % _state->framesCount()
+		frame->animationIndex
 	};
 }
 
 int Animation::frameIndex() const {
 	Expects(_state != nullptr);
 
-	const auto frame = _state->frameForPaint();
-	return frame->index % _state->framesCount();
+	return _state->frameForPaint()->animationIndex;
 }
 
 int Animation::framesCount() const {
@@ -318,6 +376,10 @@ int Animation::framesCount() const {
 	return _state->framesCount();
 }
 
+FrameTimings Animation::timings() const {
+	return _state ? _state->timings().snapshot() : FrameTimings();
+}
+
 Information Animation::information() const {
 	Expects(_state != nullptr);
 
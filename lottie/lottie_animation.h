@@ -25,11 +25,18 @@ class Player;
 class SharedState;
 class FrameRenderer;
 class FrameProvider;
+class CacheMapping;
 
-std::shared_ptr<FrameRenderer> MakeFrameRenderer();
+std::shared_ptr<FrameRenderer> MakeFrameRenderer(int threads = 1);
 
 QImage ReadThumbnail(const QByteArray &content);
 
+// The constructors with this tag get the cache as a mapping, many
+// players of the same animation read the frames from the same pages.
+struct MappedCacheTag {
+};
+inline constexpr auto kMappedCache = MappedCacheTag();
+
 namespace details {
 
 using InitData = std::variant<std::unique_ptr<SharedState>, Error>;
@@ -57,6 +64,16 @@ public:
 		const FrameRequest &request,
 		Quality quality,
 		const ColorReplacements *replacements = nullptr);
+	Animation(
+		not_null<Player*> player,
+		MappedCacheTag,
+		FnMut<void(FnMut<void(
+			std::shared_ptr<const CacheMapping> cached)>)> get, // Main thread.
+		FnMut<void(QByteArray &&cached)> put, // Unknown thread.
+		const QByteArray &content,
+		const FrameRequest &request,
+		Quality quality,
+		const ColorReplacements *replacements = nullptr);
 	Animation( // Multi-cache version.
 		not_null<Player*> player,
 		int keysCount,
@@ -78,6 +95,7 @@ public:
 	[[nodiscard]] int frameIndex() const;
 	[[nodiscard]] int framesCount() const;
 	[[nodiscard]] Information information() const;
+	[[nodiscard]] FrameTimings timings() const;
 
 private:
 	void initDone(details::InitData &&data);
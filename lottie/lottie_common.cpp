@@ -22,6 +22,22 @@ QByteArray ReadFile(const QString &filepath) {
 
 } // namespace
 
+int64 TimingHistogram::average() const {
+	return count ? (total / count) : 0;
+}
+
+int64 TimingHistogram::percentile(int percent) const {
+	const auto limit = (count * std::clamp(percent, 0, 100) + 99) / 100;
+	auto passed = int64();
+	for (auto i = 0; i != kBuckets; ++i) {
+		passed += buckets[i];
+		if (passed >= limit && passed > 0) {
+			return std::min((int64(1) << i) - 1, max);
+		}
+	}
+	return max;
+}
+
 QSize FrameRequest::size(
 		const QSize &original,
 		int sizeRounding) const {
@@ -12,6 +12,7 @@
 #include <QColor>
 #include <QImage>
 #include <crl/crl_time.h>
+#include <array>
 #include <vector>
 #include <optional>
 
@@ -30,6 +31,32 @@ struct Information {
 	int framesCount = 0;
 };
 
+struct TimingHistogram {
+	// Bucket 0 counts zero values, bucket i counts values
+	// in [2^(i-1), 2^i) microseconds, the last one all the longer.
+	static constexpr auto kBuckets = 24;
+
+	std::array<int64, kBuckets> buckets = {};
+	int64 count = 0;
+	int64 total = 0;
+	int64 max = 0;
+
+	[[nodiscard]] int64 average() const;
+
+	// Upper bound of the bucket containing the percentile.
+	[[nodiscard]] int64 percentile(int percent) const;
+};
+
+struct FrameTimings {
+	TimingHistogram render; // FrameProvider::render.
+	TimingHistogram prepare; // PrepareFrameByRequest.
+	TimingHistogram wait; // From queueing the renderer pass to the render.
+	TimingHistogram lateness; // From Frame::display to the display.
+	int64 rendered = 0;
+	int64 shared = 0; // Taken from another entry instead of rendering.
+	int64 late = 0;
+};
+
 enum class Error {
 	ParseFailed,
 	NotSupported,
@@ -63,6 +90,12 @@ enum class Quality : char {
 	Synchronous
 };
 
+enum class PlaybackMode : char {
+	Forward,
+	Reverse,
+	PingPong,
+};
+
 enum class SkinModifier {
 	None,
 	Color1,
@@ -77,6 +77,10 @@ void MultiPlayer::startAtRightTime(std::unique_ptr<SharedState> state) {
 		state.get(),
 		lastSyncTime,
 		_delay);
+	state->setAdaptiveFrameRate(_adaptiveFrameRate);
+	if (_framesRingDepth) {
+		state->setFramesRingDepth(_framesRingDepth);
+	}
 	state->start(this, _started, _delay, frameIndex);
 	const auto request = state->frameForPaint()->request;
 	_renderer->append(std::move(state), request);
@@ -166,6 +170,8 @@ void MultiPlayer::removeNow(not_null<Animation*> animation) {
 	_pendingPause.remove(animation);
 	_pendingUnpause.remove(animation);
 	_pausedBeforeStart.remove(animation);
+	_pausedByUser.remove(animation);
+	_hidden.remove(animation);
 	_animations.erase(
 		ranges::remove(
 			_animations,
@@ -185,6 +191,56 @@ void MultiPlayer::removeNow(not_null<Animation*> animation) {
 }
 
 void MultiPlayer::pause(not_null<Animation*> animation) {
+	_pausedByUser.emplace(animation);
+	applyPause(animation);
+}
+
+void MultiPlayer::unpause(not_null<Animation*> animation) {
+	_pausedByUser.remove(animation);
+	if (!_hidden.contains(animation)) {
+		applyUnpause(animation);
+	}
+}
+
+void MultiPlayer::setVisible(not_null<Animation*> animation, bool visible) {
+	if (visible) {
+		if (!_hidden.remove(animation)) {
+			return;
+		}
+		const auto i = _paused.find(animation);
+		if (i != end(_paused)) {
+			_renderer->setVisible(i->second.state, true);
+		}
+		if (!_pausedByUser.contains(animation)) {
+			applyUnpause(animation);
+		}
+	} else if (_hidden.emplace(animation).second) {
+		const auto i = _paused.find(animation);
+		if (i != end(_paused)) {
+			_renderer->setVisible(i->second.state, false);
+		}
+
+		// Active animations stop rendering when they really get paused,
+		// see pauseAndSaveState().
+		applyPause(animation);
+	}
+}
+
+void MultiPlayer::setAdaptiveFrameRate(bool adaptive) {
+	_adaptiveFrameRate = adaptive;
+	for (const auto &[animation, state] : _active) {
+		state->setAdaptiveFrameRate(adaptive);
+	}
+	for (const auto &[animation, info] : _paused) {
+		info.state->setAdaptiveFrameRate(adaptive);
+	}
+}
+
+void MultiPlayer::setFramesRingDepth(int depth) {
+	_framesRingDepth = depth;
+}
+
+void MultiPlayer::applyPause(not_null<Animation*> animation) {
 	if (_active.contains(animation)) {
 		_pendingPause.emplace(animation);
 	} else if (_paused.contains(animation)) {
@@ -196,7 +252,7 @@ void MultiPlayer::pause(not_null<Animation*> animation) {
 	}
 }
 
-void MultiPlayer::unpause(not_null<Animation*> animation) {
+void MultiPlayer::applyUnpause(not_null<Animation*> animation) {
 	if (const auto i = _paused.find(animation); i != end(_paused)) {
 		if (_active.empty()) {
 			unpauseFirst(animation, i->second.state);
@@ -235,6 +291,9 @@ void MultiPlayer::pauseAndSaveState(not_null<Animation*> animation) {
 
 	const auto i = _active.find(animation);
 	Assert(i != end(_active));
+	if (_hidden.contains(animation)) {
+		_renderer->setVisible(i->second, false);
+	}
 	_paused.emplace(
 		animation,
 		PausedInfo{ i->second, _lastSyncTime, _delay });
@@ -59,6 +59,16 @@ public:
 	void pause(not_null<Animation*> animation);
 	void unpause(not_null<Animation*> animation);
 
+	// Hidden animations are paused and the renderer frees their frames,
+	// when shown they keep up with the timeline of the others.
+	void setVisible(not_null<Animation*> animation, bool visible);
+
+	// Lower the frame rate of the animations that are expensive to render.
+	void setAdaptiveFrameRate(bool adaptive);
+
+	// Frames kept by the renderer for the animations started after that.
+	void setFramesRingDepth(int depth);
+
 private:
 	struct PausedInfo {
 		not_null<SharedState*> state;
@@ -83,6 +93,8 @@ private:
 	void addTimelineDelay(crl::time delayed);
 	void checkNextFrameAvailability();
 	void checkNextFrameRender();
+	void applyPause(not_null<Animation*> animation);
+	void applyUnpause(not_null<Animation*> animation);
 	void unpauseFirst(
 		not_null<Animation*> animation,
 		not_null<SharedState*> state);
@@ -91,6 +103,8 @@ private:
 	void removeNow(not_null<Animation*> animation);
 
 	Quality _quality = Quality::Default;
+	bool _adaptiveFrameRate = false;
+	int _framesRingDepth = 0;
 	base::Timer _timer;
 	const std::shared_ptr<FrameRenderer> _renderer;
 	std::vector<std::unique_ptr<Animation>> _animations;
@@ -100,6 +114,8 @@ private:
 	base::flat_set<not_null<Animation*>> _pendingUnpause;
 	base::flat_set<not_null<Animation*>> _pausedBeforeStart;
 	base::flat_set<not_null<Animation*>> _pendingRemove;
+	base::flat_set<not_null<Animation*>> _pausedByUser;
+	base::flat_set<not_null<Animation*>> _hidden;
 	base::flat_map<not_null<Animation*>, StartingInfo> _pendingToStart;
 	crl::time _started = kTimeUnknown;
 	crl::time _lastSyncTime = kTimeUnknown;
@@ -49,6 +49,29 @@ SinglePlayer::SinglePlayer(
 	replacements) {
 }
 
+SinglePlayer::SinglePlayer(
+	MappedCacheTag,
+	FnMut<void(FnMut<void(
+		std::shared_ptr<const CacheMapping> cached)>)> get, // Main thread.
+	FnMut<void(QByteArray &&cached)> put, // Unknown thread.
+	const QByteArray &content,
+	const FrameRequest &request,
+	Quality quality,
+	const ColorReplacements *replacements,
+	std::shared_ptr<FrameRenderer> renderer)
+: _timer([=] { checkNextFrameRender(); })
+, _renderer(renderer ? renderer : FrameRenderer::Instance())
+, _animation(
+	this,
+	kMappedCache,
+	std::move(get),
+	std::move(put),
+	content,
+	request,
+	quality,
+	replacements) {
+}
+
 SinglePlayer::SinglePlayer(
 	int keysCount,
 	FnMut<void(int, FnMut<void(QByteArray &&)>)> get,
@@ -153,9 +176,18 @@ void SinglePlayer::start(
 
 	_state = state.get();
 	auto information = state->information();
+	state->setKeepWallClock(_keepWallClock);
+	state->setAdaptiveFrameRate(_adaptiveFrameRate);
+	state->setPlaybackMode(_playbackMode);
+	if (_framesRingDepth) {
+		state->setFramesRingDepth(_framesRingDepth);
+	}
 	state->start(this, crl::now());
 	const auto request = state->frameForPaint()->request;
 	_renderer->append(std::move(state), request);
+	if (!_visible) {
+		_renderer->setVisible(_state, false);
+	}
 
 	crl::on_main_update_requests(
 	) | rpl::on_next([=] {
@@ -166,6 +198,41 @@ void SinglePlayer::start(
 	_updates.fire({ std::move(information) });
 }
 
+void SinglePlayer::setVisible(bool visible) {
+	if (_visible == visible) {
+		return;
+	}
+	_visible = visible;
+	if (_state) {
+		_renderer->setVisible(_state, visible);
+	}
+}
+
+void SinglePlayer::setKeepWallClock(bool keep) {
+	_keepWallClock = keep;
+	if (_state) {
+		_state->setKeepWallClock(keep);
+	}
+}
+
+void SinglePlayer::setAdaptiveFrameRate(bool adaptive) {
+	_adaptiveFrameRate = adaptive;
+	if (_state) {
+		_state->setAdaptiveFrameRate(adaptive);
+	}
+}
+
+void SinglePlayer::setFramesRingDepth(int depth) {
+	_framesRingDepth = depth;
+}
+
+void SinglePlayer::setPlaybackMode(PlaybackMode mode) {
+	_playbackMode = mode;
+	if (_state) {
+		_state->setPlaybackMode(mode);
+	}
+}
+
 void SinglePlayer::failed(not_null<Animation*> animation, Error error) {
 	Expects(animation == &_animation);
 
@@ -242,7 +309,9 @@ void SinglePlayer::checkNextFrameRender() {
 
 void SinglePlayer::renderFrame(crl::time now) {
 	_state->markFrameDisplayed(now);
-	_state->addTimelineDelay(now - _nextFrameTime);
+	if (!_keepWallClock) {
+		_state->addTimelineDelay(now - _nextFrameTime);
+	}
 
 	_nextFrameTime = kFrameDisplayTimeAlreadyDone;
 	_updates.fire({ DisplayFrameRequest() });
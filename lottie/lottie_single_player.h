@@ -42,6 +42,16 @@ public:
 		Quality quality = Quality::Default,
 		const ColorReplacements *replacements = nullptr,
 		std::shared_ptr<FrameRenderer> renderer = nullptr);
+	SinglePlayer(
+		MappedCacheTag,
+		FnMut<void(FnMut<void(
+			std::shared_ptr<const CacheMapping> cached)>)> get, // Main thread.
+		FnMut<void(QByteArray &&cached)> put, // Unknown thread.
+		const QByteArray &content,
+		const FrameRequest &request,
+		Quality quality = Quality::Default,
+		const ColorReplacements *replacements = nullptr,
+		std::shared_ptr<FrameRenderer> renderer = nullptr);
 	SinglePlayer( // Multi-cache version.
 		int keysCount,
 		FnMut<void(int, FnMut<void(QByteArray &&)>)> get,
@@ -76,6 +86,24 @@ public:
 	bool markFrameShown() override;
 	void checkStep() override;
 
+	// Hidden player doesn't render new frames, it continues
+	// from the same timeline position when shown again.
+	void setVisible(bool visible);
+
+	// Skip frames when rendering falls behind instead of slowing down.
+	void setKeepWallClock(bool keep);
+
+	// Lower the frame rate while the animation is expensive to render.
+	void setAdaptiveFrameRate(bool adaptive);
+
+	// Frames kept by the renderer, applied when the animation starts.
+	void setFramesRingDepth(int depth);
+
+	// Reverse and ping-pong step backwards through the cached frames.
+	// Until the cache is complete, and with legacy caches that can't
+	// seek backwards, the animation is played forward.
+	void setPlaybackMode(PlaybackMode mode);
+
 	[[nodiscard]] rpl::producer<Update, Error> updates() const;
 
 	[[nodiscard]] bool ready() const;
@@ -100,6 +128,11 @@ private:
 	const std::shared_ptr<FrameRenderer> _renderer;
 	SharedState *_state = nullptr;
 	crl::time _nextFrameTime = kTimeUnknown;
+	bool _visible = true;
+	bool _keepWallClock = false;
+	bool _adaptiveFrameRate = false;
+	PlaybackMode _playbackMode = PlaybackMode::Forward;
+	int _framesRingDepth = 0;
 	rpl::event_stream<Update, Error> _updates;
 
 	rpl::lifetime _lifetime;